@@ -34,17 +34,27 @@
 
 #include "v4l2-request-test.h"
 
-static int create_dumb_buffer(int drm_fd, unsigned int width,
-			      unsigned int height, unsigned int bpp,
+static int create_dumb_buffer(int drm_fd, struct video_buffer *video_buffer,
 			      struct gem_buffer *buffer)
 {
 	struct drm_mode_create_dumb create_dumb;
+	unsigned int bytesperline;
+	unsigned int offset = 0;
+	unsigned int height = 0;
+	unsigned int i;
 	int rc;
 
+	bytesperline = video_buffer->destination_bytesperlines[0];
+
+	/* Stack the planes in a single buffer using the luma stride. */
+	for (i = 0; i < buffer->planes_count; i++)
+		height += DIV_ROUND_UP(video_buffer->destination_sizes[i],
+				       bytesperline);
+
 	memset(&create_dumb, 0, sizeof(create_dumb));
-	create_dumb.width = width;
+	create_dumb.width = bytesperline;
 	create_dumb.height = height;
-	create_dumb.bpp = bpp;
+	create_dumb.bpp = 8;
 
 	rc = drmIoctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_dumb);
 	if (rc < 0) {
@@ -54,9 +64,17 @@ static int create_dumb_buffer(int drm_fd, unsigned int width,
 	}
 
 	buffer->size = create_dumb.size;
-	buffer->pitches[0] = create_dumb.pitch;
-	buffer->offsets[0] = 0;
-	buffer->handles[0] = create_dumb.handle;
+
+	for (i = 0; i < buffer->planes_count; i++) {
+		buffer->handles[i] = create_dumb.handle;
+		buffer->pitches[i] = create_dumb.pitch *
+				     video_buffer->destination_bytesperlines[i] /
+				     bytesperline;
+		buffer->offsets[i] = offset;
+
+		offset += buffer->pitches[i] *
+			  video_buffer->destination_heights[i];
+	}
 
 	return 0;
 }
@@ -117,16 +135,24 @@ static int destroy_buffer(int drm_fd, struct gem_buffer *buffer)
 static int close_buffer(int drm_fd, struct gem_buffer *buffer)
 {
 	struct drm_gem_close gem_close;
+	unsigned int i;
 	int rc;
 
-	memset(&gem_close, 0, sizeof(gem_close));
-	gem_close.handle = buffer->handles[0];
+	for (i = 0; i < buffer->planes_count; i++) {
+		/* Planes may share the same handle. */
+		if (buffer->handles[i] == 0 ||
+		    (i > 0 && buffer->handles[i] == buffer->handles[i - 1]))
+			continue;
 
-	rc = drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
-	if (rc < 0) {
-		fprintf(stderr, "Unable to close buffer: %s\n",
-			strerror(errno));
-		return -1;
+		memset(&gem_close, 0, sizeof(gem_close));
+		gem_close.handle = buffer->handles[i];
+
+		rc = drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+		if (rc < 0) {
+			fprintf(stderr, "Unable to close buffer: %s\n",
+				strerror(errno));
+			return -1;
+		}
 	}
 
 	return 0;
@@ -343,10 +369,10 @@ complete:
 
 static int page_flip(int drm_fd, unsigned int crtc_id, unsigned int plane_id,
 		     struct display_properties_ids *ids,
-		     unsigned int framebuffer_id)
+		     unsigned int framebuffer_id, void *user_data)
 {
 	drmModeAtomicReqPtr request;
-	uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
 	int rc;
 
 	request = drmModeAtomicAlloc();
@@ -356,7 +382,7 @@ static int page_flip(int drm_fd, unsigned int crtc_id, unsigned int plane_id,
 	drmModeAtomicAddProperty(request, plane_id, ids->plane_crtc_id,
 				 crtc_id);
 
-	rc = drmModeAtomicCommit(drm_fd, request, flags, NULL);
+	rc = drmModeAtomicCommit(drm_fd, request, flags, user_data);
 	if (rc < 0) {
 		fprintf(stderr, "Unable to flip page: %s\n", strerror(errno));
 		goto error;
@@ -374,6 +400,15 @@ complete:
 	return rc;
 }
 
+static void page_flip_handler(int drm_fd, unsigned int sequence,
+			      unsigned int tv_sec, unsigned int tv_usec,
+			      void *user_data)
+{
+	struct display_setup *setup = user_data;
+
+	setup->flip_pending = false;
+}
+
 static int select_connector_encoder(int drm_fd, unsigned int *connector_id,
 				    unsigned int *encoder_id)
 {
@@ -481,8 +516,80 @@ complete:
 	return rc;
 }
 
+static bool plane_format_test(int drm_fd, drmModePlanePtr plane,
+			      unsigned int format, uint64_t modifier)
+{
+	drmModeObjectPropertiesPtr properties;
+	drmModePropertyPtr property;
+	drmModePropertyBlobPtr blob = NULL;
+	struct drm_format_modifier_blob *header;
+	struct drm_format_modifier *modifiers;
+	uint32_t *formats;
+	bool found = false;
+	unsigned int i, j;
+
+	for (i = 0; i < plane->count_formats; i++)
+		if (plane->formats[i] == format)
+			break;
+
+	if (i == plane->count_formats)
+		return false;
+
+	properties = drmModeObjectGetProperties(drm_fd, plane->plane_id,
+						DRM_MODE_OBJECT_PLANE);
+	if (properties == NULL)
+		return false;
+
+	for (i = 0; i < properties->count_props; i++) {
+		property = drmModeGetProperty(drm_fd, properties->props[i]);
+		if (property == NULL)
+			continue;
+
+		if (strcmp(property->name, "IN_FORMATS") == 0)
+			blob = drmModeGetPropertyBlob(drm_fd,
+						      properties->prop_values[i]);
+
+		drmModeFreeProperty(property);
+
+		if (blob != NULL)
+			break;
+	}
+
+	drmModeFreeObjectProperties(properties);
+
+	/* Planes without modifiers support only scan out linear buffers. */
+	if (blob == NULL)
+		return modifier == DRM_FORMAT_MOD_LINEAR;
+
+	header = blob->data;
+	formats = (uint32_t *)((unsigned char *)header + header->formats_offset);
+	modifiers = (struct drm_format_modifier *)
+		((unsigned char *)header + header->modifiers_offset);
+
+	for (i = 0; i < header->count_formats; i++)
+		if (formats[i] == format)
+			break;
+
+	for (j = 0; i < header->count_formats && j < header->count_modifiers;
+	     j++) {
+		if (modifiers[j].modifier != modifier ||
+		    i < modifiers[j].offset || i >= modifiers[j].offset + 64)
+			continue;
+
+		if (modifiers[j].formats & (1ULL << (i - modifiers[j].offset))) {
+			found = true;
+			break;
+		}
+	}
+
+	drmModeFreePropertyBlob(blob);
+
+	return found;
+}
+
 static int select_plane(int drm_fd, unsigned int crtc_id, unsigned int format,
-			unsigned int *plane_id, unsigned int *zpos)
+			uint64_t modifier, unsigned int *plane_id,
+			unsigned int *zpos)
 {
 	drmModeResPtr ressources = NULL;
 	drmModePlaneResPtr plane_ressources = NULL;
@@ -494,7 +601,6 @@ static int select_plane(int drm_fd, unsigned int crtc_id, unsigned int format,
 	unsigned int crtc_index;
 	unsigned int type;
 	unsigned int i, j;
-	bool format_found;
 	int rc;
 
 	ressources = drmModeGetResources(drm_fd);
@@ -594,24 +700,16 @@ static int select_plane(int drm_fd, unsigned int crtc_id, unsigned int format,
 		if (type != DRM_PLANE_TYPE_OVERLAY)
 			continue;
 
-		format_found = false;
-
-		for (j = 0; j < plane->count_formats; j++)
-			if (plane->formats[j] == format)
-				format_found = true;
-
-		if (format_found)
+		if (plane_format_test(drm_fd, plane, format, modifier))
 			break;
 
 		drmModeFreePlane(plane);
 		plane = NULL;
 	}
 
-	if (plane == NULL || i == plane_ressources->count_planes) {
-		fprintf(stderr, "Unable to find any plane for CRTC %d\n",
-			crtc_id);
+	/* No matching plane is not an error when testing formats. */
+	if (plane == NULL || i == plane_ressources->count_planes)
 		goto error;
-	}
 
 	if (plane_id != NULL)
 		*plane_id = plane->plane_id;
@@ -645,6 +743,129 @@ complete:
 	return rc;
 }
 
+static int setup_buffers(int drm_fd, unsigned int width, unsigned int height,
+			 struct format_description *format,
+			 struct video_buffer *video_buffers,
+			 struct gem_buffer *buffers, unsigned int first,
+			 unsigned int count, bool use_dmabuf)
+{
+	struct video_buffer *video_buffer;
+	struct gem_buffer *buffer;
+	unsigned int export_fds_count;
+	unsigned int i;
+	int rc;
+
+	for (i = first; i < first + count; i++) {
+		buffer = &buffers[i];
+
+		/*
+		 * Copy buffers don't match any video buffer, which all share the
+		 * same layout, and there may be a single one of those.
+		 */
+		video_buffer = &video_buffers[use_dmabuf ? i : 0];
+		export_fds_count = video_buffer->destination_buffers_count;
+
+		buffer->planes_count = format->planes_count;
+
+		if (use_dmabuf)
+			rc = create_imported_buffer(drm_fd,
+						    video_buffer->export_fds,
+						    export_fds_count,
+						    video_buffer->destination_offsets,
+						    video_buffer->destination_bytesperlines,
+						    buffer);
+		else
+			rc = create_dumb_buffer(drm_fd, video_buffer, buffer);
+
+		if (rc < 0) {
+			fprintf(stderr,
+				"Unable to create or import DRM buffer\n");
+			return -1;
+		}
+
+		rc = add_framebuffer(drm_fd, buffer, width, height,
+				     format->drm_format, format->drm_modifier);
+		if (rc < 0) {
+			fprintf(stderr, "Unable to add DRM framebuffer\n");
+			return -1;
+		}
+
+		if (!use_dmabuf) {
+			rc = map_buffer(drm_fd, buffer);
+			if (rc < 0) {
+				fprintf(stderr, "Unable to map DRM buffer\n");
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void plane_geometry(unsigned int width, unsigned int height,
+			   unsigned int crtc_width, unsigned int crtc_height,
+			   unsigned int *x, unsigned int *y,
+			   unsigned int *scaled_width,
+			   unsigned int *scaled_height)
+{
+	*scaled_height = (height * crtc_width) / width;
+
+	if (*scaled_height > crtc_height) {
+		/* Scale to CRTC height. */
+		*scaled_width = (width * crtc_height) / height;
+		*scaled_height = crtc_height;
+	} else {
+		/* Scale to CRTC width. */
+		*scaled_width = crtc_width;
+	}
+
+	*x = (crtc_width - *scaled_width) / 2;
+	*y = (crtc_height - *scaled_height) / 2;
+
+	if (*scaled_width != width || *scaled_height != height)
+		printf("Scaling video from %dx%d to %dx%d+%d+%d\n", width,
+		       height, *scaled_width, *scaled_height, *x, *y);
+}
+
+static int release_buffers(int drm_fd, struct gem_buffer *buffers,
+			   unsigned int count, bool use_dmabuf)
+{
+	struct gem_buffer *buffer;
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < count; i++) {
+		buffer = &buffers[i];
+
+		if (buffer->framebuffer_id != 0)
+			drmModeRmFB(drm_fd, buffer->framebuffer_id);
+
+		if (use_dmabuf) {
+			rc = close_buffer(drm_fd, buffer);
+			if (rc < 0) {
+				fprintf(stderr, "Unable to close buffer %d\n", i);
+				return -1;
+			}
+		} else {
+			rc = unmap_buffer(drm_fd, buffer);
+			if (rc < 0) {
+				fprintf(stderr, "Unable to unmap buffer %d\n", i);
+				return -1;
+			}
+
+			rc = destroy_buffer(drm_fd, buffer);
+			if (rc < 0) {
+				fprintf(stderr, "Unable to destroy buffer %d\n", i);
+				return -1;
+			}
+		}
+	}
+
+	free(buffers);
+
+	return 0;
+}
+
 int display_engine_start(int drm_fd, unsigned int width, unsigned int height,
 			 struct format_description *format,
 			 struct video_buffer *video_buffers, unsigned int count,
@@ -694,8 +915,8 @@ int display_engine_start(int drm_fd, unsigned int width, unsigned int height,
 		return -1;
 	}
 
-	rc = select_plane(drm_fd, crtc_id, format->drm_format, &plane_id,
-			  &zpos);
+	rc = select_plane(drm_fd, crtc_id, format->drm_format,
+			  format->drm_modifier, &plane_id, &zpos);
 	if (rc < 0) {
 		fprintf(stderr, "Unable to select DRM plane for CRTC %d\n",
 			crtc_id);
@@ -738,63 +959,13 @@ int display_engine_start(int drm_fd, unsigned int width, unsigned int height,
 	*buffers = malloc(count * sizeof(**buffers));
 	memset(*buffers, 0, count * sizeof(**buffers));
 
-	for (i = 0; i < count; i++) {
-		buffer = &((*buffers)[i]);
-		video_buffer = &video_buffers[i];
-		export_fds_count = video_buffer->destination_buffers_count;
-
-		buffer->planes_count = format->planes_count;
-
-		if (use_dmabuf)
-			rc = create_imported_buffer(drm_fd,
-						    video_buffer->export_fds,
-						    export_fds_count,
-						    video_buffer->destination_offsets,
-						    video_buffer->destination_bytesperlines,
-						    buffer);
-		else
-			rc = create_dumb_buffer(drm_fd, width, height,
-						format->bpp, buffer);
-
-		if (rc < 0) {
-			fprintf(stderr,
-				"Unable to create or import DRM buffer\n");
-			return -1;
-		}
-
-		rc = add_framebuffer(drm_fd, buffer, width, height,
-				     format->drm_format, format->drm_modifier);
-		if (rc < 0) {
-			fprintf(stderr, "Unable to add DRM framebuffer\n");
-			return -1;
-		}
-
-		if (!use_dmabuf) {
-			rc = map_buffer(drm_fd, buffer);
-			if (rc < 0) {
-				fprintf(stderr, "Unable to map DRM buffer\n");
-				return -1;
-			}
-		}
-	}
-
-	scaled_height = (height * crtc_width) / width;
-
-	if (scaled_height > crtc_height) {
-		/* Scale to CRTC height. */
-		scaled_width = (width * crtc_height) / height;
-		scaled_height = crtc_height;
-	} else {
-		/* Scale to CRTC width. */
-		scaled_width = crtc_width;
-	}
-
-	x = (crtc_width - scaled_width) / 2;
-	y = (crtc_height - scaled_height) / 2;
+	rc = setup_buffers(drm_fd, width, height, format, video_buffers,
+			   *buffers, 0, count, use_dmabuf);
+	if (rc < 0)
+		return -1;
 
-	if (scaled_width != width || scaled_height != height)
-		printf("Scaling video from %dx%d to %dx%d+%d+%d\n", width,
-		       height, scaled_width, scaled_height, x, y);
+	plane_geometry(width, height, crtc_width, crtc_height, &x, &y,
+		       &scaled_width, &scaled_height);
 
 	buffer = &((*buffers)[0]);
 
@@ -817,47 +988,201 @@ int display_engine_start(int drm_fd, unsigned int width, unsigned int height,
 	setup->scaled_height = scaled_height;
 	setup->x = x;
 	setup->y = y;
+	setup->crtc_width = crtc_width;
+	setup->crtc_height = crtc_height;
+	setup->zpos = zpos;
 	setup->buffers_count = count;
 	setup->use_dmabuf = use_dmabuf;
+	setup->flip_pending = false;
+
+	/* The first dumb buffer is on screen from the initial commit. */
+	setup->copy_index = 1;
 
 	return 0;
 }
 
-int display_engine_stop(int drm_fd, struct gem_buffer *buffers,
+int display_engine_grow(int drm_fd, struct format_description *format,
+			struct video_buffer *video_buffers, unsigned int count,
+			struct gem_buffer **buffers,
 			struct display_setup *setup)
 {
-	struct gem_buffer *buffer;
-	unsigned int i;
+	struct gem_buffer *grown;
+	unsigned int first;
 	int rc;
 
+	/* Copied frames keep going through the same two dumb buffers. */
+	if (!setup->use_dmabuf || count <= setup->buffers_count)
+		return 0;
+
+	first = setup->buffers_count;
+
+	grown = realloc(*buffers, count * sizeof(**buffers));
+	if (grown == NULL) {
+		fprintf(stderr, "Unable to allocate DRM buffers\n");
+		return -1;
+	}
+
+	memset(&grown[first], 0, (count - first) * sizeof(**buffers));
+
+	*buffers = grown;
+	setup->buffers_count = count;
+
+	rc = setup_buffers(drm_fd, setup->width, setup->height, format,
+			   video_buffers, grown, first, count - first, true);
+	if (rc < 0)
+		return -1;
+
+	return 0;
+}
+
+int display_engine_stop(int drm_fd, struct gem_buffer *buffers,
+			struct display_setup *setup)
+{
 	if (buffers == NULL || setup == NULL)
 		return -1;
 
-	for (i = 0; i < setup->buffers_count; i++) {
-		buffer = &buffers[i];
+	return release_buffers(drm_fd, buffers, setup->buffers_count,
+			       setup->use_dmabuf);
+}
 
-		if (setup->use_dmabuf) {
-			rc = close_buffer(drm_fd, buffer);
-			if (rc < 0) {
-				fprintf(stderr, "Unable to close buffer %d\n", i);
-				return -1;
-			}
-		} else {
-			rc = unmap_buffer(drm_fd, buffer);
-			if (rc < 0) {
-				fprintf(stderr, "Unable to unmap buffer %d\n", i);
-				return -1;
-			}
+int display_engine_resize(int drm_fd, unsigned int width, unsigned int height,
+			  struct format_description *format,
+			  struct video_buffer *video_buffers,
+			  unsigned int count, struct gem_buffer **buffers,
+			  struct display_setup *setup)
+{
+	struct gem_buffer *resized;
+	unsigned int scaled_width, scaled_height;
+	unsigned int x, y;
+	int rc;
 
-			rc = destroy_buffer(drm_fd, buffer);
-			if (rc < 0) {
-				fprintf(stderr, "Unable to destroy buffer %d\n", i);
-				return -1;
-			}
-		}
+	if (setup->flip_pending) {
+		fprintf(stderr, "Unable to resize display with a pending flip\n");
+		return -1;
+	}
+
+	if (!setup->use_dmabuf)
+		count = 2;
+
+	resized = calloc(count, sizeof(*resized));
+	if (resized == NULL) {
+		fprintf(stderr, "Unable to allocate DRM buffers\n");
+		return -1;
 	}
 
+	rc = setup_buffers(drm_fd, width, height, format, video_buffers,
+			   resized, 0, count, setup->use_dmabuf);
+	if (rc < 0)
+		goto error;
+
+	plane_geometry(width, height, setup->crtc_width, setup->crtc_height,
+		       &x, &y, &scaled_width, &scaled_height);
+
+	/* Switch the framebuffer and the plane geometry at once. */
+	rc = commit_atomic_mode(drm_fd, setup->connector_id, setup->crtc_id,
+				setup->plane_id, &setup->properties_ids,
+				resized[0].framebuffer_id, width, height, x, y,
+				scaled_width, scaled_height, setup->zpos);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to commit resized plane\n");
+		goto error;
+	}
+
+	release_buffers(drm_fd, *buffers, setup->buffers_count,
+			setup->use_dmabuf);
+
+	*buffers = resized;
+
+	setup->width = width;
+	setup->height = height;
+	setup->scaled_width = scaled_width;
+	setup->scaled_height = scaled_height;
+	setup->x = x;
+	setup->y = y;
+	setup->buffers_count = count;
+	setup->copy_index = 1;
+
 	return 0;
+
+error:
+	release_buffers(drm_fd, resized, count, setup->use_dmabuf);
+
+	return -1;
+}
+
+int display_engine_memory_create(int drm_fd, unsigned int size, int *fd,
+				 void **map)
+{
+	struct drm_mode_create_dumb create_dumb;
+	struct drm_mode_map_dumb map_dumb;
+	struct drm_gem_close gem_close;
+	void *data = MAP_FAILED;
+	int export_fd = -1;
+	int rc;
+
+	/* Any shape works as long as the buffer covers the requested size. */
+	memset(&create_dumb, 0, sizeof(create_dumb));
+	create_dumb.width = 4096;
+	create_dumb.height = DIV_ROUND_UP(size, create_dumb.width);
+	create_dumb.bpp = 8;
+
+	rc = drmIoctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_dumb);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to create dumb buffer: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	rc = drmPrimeHandleToFD(drm_fd, create_dumb.handle,
+				DRM_CLOEXEC | DRM_RDWR, &export_fd);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to export dumb buffer: %s\n",
+			strerror(errno));
+		goto error;
+	}
+
+	if (map != NULL) {
+		memset(&map_dumb, 0, sizeof(map_dumb));
+		map_dumb.handle = create_dumb.handle;
+
+		rc = drmIoctl(drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb);
+		if (rc < 0) {
+			fprintf(stderr, "Unable to map dumb buffer: %s\n",
+				strerror(errno));
+			goto error;
+		}
+
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    drm_fd, map_dumb.offset);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "Unable to mmap dumb buffer: %s\n",
+				strerror(errno));
+			goto error;
+		}
+	}
+
+	*fd = export_fd;
+
+	if (map != NULL)
+		*map = data;
+
+	rc = 0;
+	goto complete;
+
+error:
+	if (export_fd >= 0)
+		close(export_fd);
+
+	rc = -1;
+
+complete:
+	/* The exported file descriptor and mapping keep the buffer alive. */
+	memset(&gem_close, 0, sizeof(gem_close));
+	gem_close.handle = create_dumb.handle;
+
+	drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+
+	return rc;
 }
 
 int display_engine_show(int drm_fd, unsigned int index,
@@ -866,32 +1191,170 @@ int display_engine_show(int drm_fd, unsigned int index,
 {
 	struct video_buffer *video_buffer;
 	struct gem_buffer *buffer;
-	unsigned int i;
+	unsigned char *source;
+	unsigned char *destination;
+	unsigned int bytesperline;
+	unsigned int i, j;
 	int rc;
 
 	if (buffers == NULL || setup == NULL)
 		return -1;
 
+	if (setup->flip_pending) {
+		fprintf(stderr, "Unable to show frame with a pending flip\n");
+		return -1;
+	}
+
 	video_buffer = &video_buffers[index];
-	buffer = &buffers[index];
 
-	if (!setup->use_dmabuf) {
-		for (i = 0; i < buffer->planes_count; i++)
-			memcpy((unsigned char *)buffer->data +
-				       buffer->offsets[i],
-			       video_buffer->destination_data[i],
-			       video_buffer->destination_sizes[i]);
+	if (setup->use_dmabuf) {
+		buffer = &buffers[index];
+	} else {
+		/* Alternate between the two buffers to avoid tearing. */
+		buffer = &buffers[setup->copy_index];
+		setup->copy_index = (setup->copy_index + 1) % 2;
+
+		for (i = 0; i < buffer->planes_count; i++) {
+			source = video_buffer->destination_data[i];
+			destination = (unsigned char *)buffer->data +
+				      buffer->offsets[i];
+			bytesperline =
+				video_buffer->destination_bytesperlines[i];
+
+			if (buffer->pitches[i] == bytesperline) {
+				memcpy(destination, source,
+				       video_buffer->destination_sizes[i]);
+				continue;
+			}
 
-		buffer = index % 2 == 0 ? &buffers[0] : &buffers[1];
+			for (j = 0; j < video_buffer->destination_heights[i];
+			     j++)
+				memcpy(destination + j * buffer->pitches[i],
+				       source + j * bytesperline,
+				       bytesperline < buffer->pitches[i] ?
+					       bytesperline :
+					       buffer->pitches[i]);
+		}
 	}
 
 	rc = page_flip(drm_fd, setup->crtc_id, setup->plane_id,
-		       &setup->properties_ids, buffer->framebuffer_id);
+		       &setup->properties_ids, buffer->framebuffer_id, setup);
 	if (rc < 0) {
 		fprintf(stderr, "Unable to flip page to framebuffer %d\n",
 			buffer->framebuffer_id);
 		return -1;
 	}
 
+	setup->flip_pending = true;
+
+	return 0;
+}
+
+int display_engine_handle_events(int drm_fd, struct display_setup *setup)
+{
+	drmEventContext context;
+	int rc;
+
+	memset(&context, 0, sizeof(context));
+	context.version = 2;
+	context.page_flip_handler = page_flip_handler;
+
+	rc = drmHandleEvent(drm_fd, &context);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to handle DRM events\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+bool display_engine_format_test(int drm_fd, unsigned int format,
+				uint64_t modifier)
+{
+	unsigned int connector_id;
+	unsigned int encoder_id;
+	unsigned int crtc_id;
+	drmModeModeInfo mode;
+	int rc;
+
+	rc = drmSetClientCap(drm_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+	if (rc < 0)
+		return false;
+
+	rc = select_connector_encoder(drm_fd, &connector_id, &encoder_id);
+	if (rc < 0)
+		return false;
+
+	rc = select_crtc(drm_fd, encoder_id, &crtc_id, &mode);
+	if (rc < 0)
+		return false;
+
+	rc = select_plane(drm_fd, crtc_id, format, modifier, NULL, NULL);
+
+	return rc >= 0;
+}
+
+int display_engine_discover(bool platform, char *path, unsigned int path_size,
+			    char *driver, unsigned int driver_size)
+{
+	drmDevicePtr devices[16];
+	drmModeResPtr resources;
+	drmVersionPtr version;
+	int selected = -1;
+	int devices_count;
+	bool display;
+	int drm_fd;
+	int i;
+
+	devices_count = drmGetDevices2(0, devices, ARRAY_SIZE(devices));
+	if (devices_count < 0) {
+		fprintf(stderr, "Unable to list DRM devices\n");
+		return -1;
+	}
+
+	/* Only devices with a display pipeline are of interest. */
+	for (i = 0; i < devices_count; i++) {
+		if (!(devices[i]->available_nodes & (1 << DRM_NODE_PRIMARY)))
+			continue;
+
+		drm_fd = open(devices[i]->nodes[DRM_NODE_PRIMARY], O_RDWR);
+		if (drm_fd < 0)
+			continue;
+
+		resources = drmModeGetResources(drm_fd);
+		display = resources != NULL && resources->count_crtcs > 0 &&
+			  resources->count_connectors > 0;
+
+		if (resources != NULL)
+			drmModeFreeResources(resources);
+
+		version = display ? drmGetVersion(drm_fd) : NULL;
+
+		close(drm_fd);
+
+		if (version == NULL)
+			continue;
+
+		/* SoC decoders go with the display engine on the same bus. */
+		if (selected < 0 ||
+		    (platform && devices[i]->bustype == DRM_BUS_PLATFORM &&
+		     devices[selected]->bustype != DRM_BUS_PLATFORM)) {
+			selected = i;
+
+			snprintf(path, path_size, "%s",
+				 devices[i]->nodes[DRM_NODE_PRIMARY]);
+			snprintf(driver, driver_size, "%s", version->name);
+		}
+
+		drmFreeVersion(version);
+	}
+
+	drmFreeDevices(devices, devices_count);
+
+	if (selected < 0) {
+		fprintf(stderr, "Unable to find any DRM display device\n");
+		return -1;
+	}
+
 	return 0;
 }
@@ -0,0 +1,127 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * These are the stable H.264 stateless controls, as found in mainline
+ * linux/v4l2-controls.h.
+ *
+ * Structures that changed since the staging version in h264-ctrls.h are
+ * renamed with a stateless prefix so that both can be used side by side.
+ * The sequence and picture parameter sets and the scaling matrix kept the
+ * same layout and are shared with the staging version.
+ */
+
+#ifndef _H264_STATELESS_CTRLS_H_
+#define _H264_STATELESS_CTRLS_H_
+
+#include <linux/videodev2.h>
+
+#ifndef V4L2_CTRL_CLASS_CODEC_STATELESS
+#define V4L2_CTRL_CLASS_CODEC_STATELESS 0x00a40000
+#endif
+
+#ifndef V4L2_CID_CODEC_STATELESS_BASE
+#define V4L2_CID_CODEC_STATELESS_BASE (V4L2_CTRL_CLASS_CODEC_STATELESS | 0x900)
+#endif
+
+#ifndef V4L2_CID_STATELESS_H264_DECODE_MODE
+#define V4L2_CID_STATELESS_H264_DECODE_MODE	(V4L2_CID_CODEC_STATELESS_BASE + 0)
+#define V4L2_CID_STATELESS_H264_START_CODE	(V4L2_CID_CODEC_STATELESS_BASE + 1)
+#define V4L2_CID_STATELESS_H264_SPS		(V4L2_CID_CODEC_STATELESS_BASE + 2)
+#define V4L2_CID_STATELESS_H264_PPS		(V4L2_CID_CODEC_STATELESS_BASE + 3)
+#define V4L2_CID_STATELESS_H264_SCALING_MATRIX	(V4L2_CID_CODEC_STATELESS_BASE + 4)
+#define V4L2_CID_STATELESS_H264_PRED_WEIGHTS	(V4L2_CID_CODEC_STATELESS_BASE + 5)
+#define V4L2_CID_STATELESS_H264_SLICE_PARAMS	(V4L2_CID_CODEC_STATELESS_BASE + 6)
+#define V4L2_CID_STATELESS_H264_DECODE_PARAMS	(V4L2_CID_CODEC_STATELESS_BASE + 7)
+#endif
+
+/* Values of the decode mode and start code menu controls */
+#define V4L2_STATELESS_H264_DECODE_MODE_SLICE_BASED	0
+#define V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED	1
+
+#define V4L2_STATELESS_H264_START_CODE_NONE		0
+#define V4L2_STATELESS_H264_START_CODE_ANNEX_B		1
+
+#define V4L2_STATELESS_H264_NUM_DPB_ENTRIES		16
+#define V4L2_STATELESS_H264_REF_LIST_LEN		(2 * V4L2_STATELESS_H264_NUM_DPB_ENTRIES)
+
+struct v4l2_stateless_h264_pred_weights {
+	__u16 luma_log2_weight_denom;
+	__u16 chroma_log2_weight_denom;
+	struct v4l2_h264_weight_factors weight_factors[2];
+};
+
+#define V4L2_STATELESS_H264_SLICE_FLAG_DIRECT_SPATIAL_MV_PRED	0x01
+#define V4L2_STATELESS_H264_SLICE_FLAG_SP_FOR_SWITCH		0x02
+
+#define V4L2_STATELESS_H264_TOP_FIELD_REF			0x1
+#define V4L2_STATELESS_H264_BOTTOM_FIELD_REF			0x2
+#define V4L2_STATELESS_H264_FRAME_REF				0x3
+
+struct v4l2_stateless_h264_reference {
+	__u8 fields;
+	/* Index into v4l2_stateless_h264_decode_params.dpb[] */
+	__u8 index;
+};
+
+struct v4l2_stateless_h264_slice_params {
+	__u32 header_bit_size;
+	__u32 first_mb_in_slice;
+	__u8 slice_type;
+	__u8 colour_plane_id;
+	__u8 redundant_pic_cnt;
+	__u8 cabac_init_idc;
+	__s8 slice_qp_delta;
+	__s8 slice_qs_delta;
+	__u8 disable_deblocking_filter_idc;
+	__s8 slice_alpha_c0_offset_div2;
+	__s8 slice_beta_offset_div2;
+	__u8 num_ref_idx_l0_active_minus1;
+	__u8 num_ref_idx_l1_active_minus1;
+
+	__u8 reserved;
+
+	struct v4l2_stateless_h264_reference ref_pic_list0[V4L2_STATELESS_H264_REF_LIST_LEN];
+	struct v4l2_stateless_h264_reference ref_pic_list1[V4L2_STATELESS_H264_REF_LIST_LEN];
+
+	__u32 flags;
+};
+
+#define V4L2_STATELESS_H264_DPB_ENTRY_FLAG_VALID		0x01
+#define V4L2_STATELESS_H264_DPB_ENTRY_FLAG_ACTIVE		0x02
+#define V4L2_STATELESS_H264_DPB_ENTRY_FLAG_LONG_TERM		0x04
+#define V4L2_STATELESS_H264_DPB_ENTRY_FLAG_FIELD		0x08
+
+struct v4l2_stateless_h264_dpb_entry {
+	__u64 reference_ts;
+	__u32 pic_num;
+	__u16 frame_num;
+	__u8 fields;
+	__u8 reserved[5];
+	__s32 top_field_order_cnt;
+	__s32 bottom_field_order_cnt;
+	__u32 flags;
+};
+
+#define V4L2_STATELESS_H264_DECODE_PARAM_FLAG_IDR_PIC		0x01
+#define V4L2_STATELESS_H264_DECODE_PARAM_FLAG_FIELD_PIC		0x02
+#define V4L2_STATELESS_H264_DECODE_PARAM_FLAG_BOTTOM_FIELD	0x04
+
+struct v4l2_stateless_h264_decode_params {
+	struct v4l2_stateless_h264_dpb_entry dpb[V4L2_STATELESS_H264_NUM_DPB_ENTRIES];
+	__u16 nal_ref_idc;
+	__u16 frame_num;
+	__s32 top_field_order_cnt;
+	__s32 bottom_field_order_cnt;
+	__u16 idr_pic_id;
+	__u16 pic_order_cnt_lsb;
+	__s32 delta_pic_order_cnt_bottom;
+	__s32 delta_pic_order_cnt0;
+	__s32 delta_pic_order_cnt1;
+	__u32 dec_ref_pic_marking_bit_size;
+	__u32 pic_order_cnt_bit_size;
+	__u32 slice_group_change_cycle;
+
+	__u32 reserved;
+	__u32 flags;
+};
+
+#endif
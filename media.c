@@ -0,0 +1,534 @@
+/*
+ * Copyright (C) 2018 Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <linux/media.h>
+
+#include "v4l2-request-test.h"
+
+static const char *codec_name(enum codec_type type)
+{
+	switch (type) {
+	case CODEC_TYPE_MPEG2:
+		return "mpeg2";
+	case CODEC_TYPE_H264:
+		return "h264";
+	case CODEC_TYPE_H265:
+		return "h265";
+	default:
+		return "invalid";
+	}
+}
+
+static int devnode_path(unsigned int major, unsigned int minor, char *path,
+			unsigned int path_size)
+{
+	char *uevent_path = NULL;
+	char line[256];
+	FILE *file;
+	int rc = -1;
+
+	/* Device names are only known to sysfs, not to the media device. */
+	asprintf(&uevent_path, "/sys/dev/char/%u:%u/uevent", major, minor);
+
+	file = fopen(uevent_path, "r");
+	free(uevent_path);
+
+	if (file == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (strncmp(line, "DEVNAME=", 8) != 0)
+			continue;
+
+		line[strcspn(line, "\n")] = '\0';
+		snprintf(path, path_size, "/dev/%s", line + 8);
+		rc = 0;
+		break;
+	}
+
+	fclose(file);
+
+	return rc;
+}
+
+static int get_topology(int media_fd, struct media_v2_topology *topology)
+{
+	struct media_v2_entity *entities = NULL;
+	struct media_v2_interface *interfaces = NULL;
+	struct media_v2_pad *pads = NULL;
+	struct media_v2_link *links = NULL;
+	int rc;
+
+	memset(topology, 0, sizeof(*topology));
+
+	rc = ioctl(media_fd, MEDIA_IOC_G_TOPOLOGY, topology);
+	if (rc < 0)
+		goto error;
+
+	entities = calloc(topology->num_entities + 1, sizeof(*entities));
+	interfaces = calloc(topology->num_interfaces + 1, sizeof(*interfaces));
+	pads = calloc(topology->num_pads + 1, sizeof(*pads));
+	links = calloc(topology->num_links + 1, sizeof(*links));
+	if (entities == NULL || interfaces == NULL || pads == NULL ||
+	    links == NULL)
+		goto error;
+
+	topology->ptr_entities = (uintptr_t)entities;
+	topology->ptr_interfaces = (uintptr_t)interfaces;
+	topology->ptr_pads = (uintptr_t)pads;
+	topology->ptr_links = (uintptr_t)links;
+
+	rc = ioctl(media_fd, MEDIA_IOC_G_TOPOLOGY, topology);
+	if (rc < 0)
+		goto error;
+
+	return 0;
+
+error:
+	free(entities);
+	free(interfaces);
+	free(pads);
+	free(links);
+
+	memset(topology, 0, sizeof(*topology));
+
+	return -1;
+}
+
+static void put_topology(struct media_v2_topology *topology)
+{
+	free((void *)(uintptr_t)topology->ptr_entities);
+	free((void *)(uintptr_t)topology->ptr_interfaces);
+	free((void *)(uintptr_t)topology->ptr_pads);
+	free((void *)(uintptr_t)topology->ptr_links);
+}
+
+static int pad_entity(struct media_v2_topology *topology, unsigned int pad_id)
+{
+	struct media_v2_pad *pads = (void *)(uintptr_t)topology->ptr_pads;
+	unsigned int i;
+
+	for (i = 0; i < topology->num_pads; i++)
+		if (pads[i].id == pad_id)
+			return pads[i].entity_id;
+
+	return -1;
+}
+
+/*
+ * Memory-to-memory decoders expose a processing entity, data-linked to the
+ * source and sink entities that the video interface is linked to.
+ */
+static bool entity_linked(struct media_v2_topology *topology,
+			  unsigned int entity_id, unsigned int decoder_id)
+{
+	struct media_v2_link *links = (void *)(uintptr_t)topology->ptr_links;
+	unsigned int type;
+	unsigned int i;
+
+	if (entity_id == decoder_id)
+		return true;
+
+	for (i = 0; i < topology->num_links; i++) {
+		type = links[i].flags & MEDIA_LNK_FL_LINK_TYPE;
+		if (type != MEDIA_LNK_FL_DATA_LINK)
+			continue;
+
+		if ((pad_entity(topology, links[i].source_id) ==
+			     (int)entity_id &&
+		     pad_entity(topology, links[i].sink_id) ==
+			     (int)decoder_id) ||
+		    (pad_entity(topology, links[i].source_id) ==
+			     (int)decoder_id &&
+		     pad_entity(topology, links[i].sink_id) ==
+			     (int)entity_id))
+			return true;
+	}
+
+	return false;
+}
+
+/* Decoders are appended to the list, each video node only once. */
+static int find_decoders(int media_fd, const char *media_path,
+			 enum codec_type type, struct media_decoder *decoders,
+			 unsigned int decoders_max,
+			 unsigned int *decoders_count)
+{
+	struct media_v2_topology topology;
+	struct media_v2_entity *entities;
+	struct media_v2_interface *interfaces;
+	struct media_v2_link *links;
+	struct media_decoder *decoder;
+	unsigned int interface_id;
+	unsigned int count;
+	unsigned int i, j, k, l;
+	bool test;
+	int video_fd;
+	int rc;
+
+	rc = get_topology(media_fd, &topology);
+	if (rc < 0)
+		return -1;
+
+	entities = (void *)(uintptr_t)topology.ptr_entities;
+	interfaces = (void *)(uintptr_t)topology.ptr_interfaces;
+	links = (void *)(uintptr_t)topology.ptr_links;
+
+	count = *decoders_count;
+
+	for (i = 0; i < topology.num_entities; i++) {
+		if (*decoders_count == decoders_max)
+			break;
+
+		if (entities[i].function != MEDIA_ENT_F_PROC_VIDEO_DECODER)
+			continue;
+
+		for (j = 0; j < topology.num_links; j++) {
+			if ((links[j].flags & MEDIA_LNK_FL_LINK_TYPE) !=
+			    MEDIA_LNK_FL_INTERFACE_LINK)
+				continue;
+
+			if (!entity_linked(&topology, links[j].sink_id,
+					   entities[i].id))
+				continue;
+
+			interface_id = links[j].source_id;
+
+			for (k = 0; k < topology.num_interfaces; k++)
+				if (interfaces[k].id == interface_id)
+					break;
+
+			if (k == topology.num_interfaces ||
+			    interfaces[k].intf_type != MEDIA_INTF_T_V4L_VIDEO)
+				continue;
+
+			decoder = &decoders[*decoders_count];
+
+			rc = devnode_path(interfaces[k].devnode.major,
+					  interfaces[k].devnode.minor,
+					  decoder->video_path,
+					  sizeof(decoder->video_path));
+			if (rc < 0)
+				continue;
+
+			for (l = 0; l < *decoders_count; l++)
+				if (strcmp(decoders[l].video_path,
+					   decoder->video_path) == 0)
+					break;
+
+			if (l < *decoders_count)
+				continue;
+
+			video_fd = open(decoder->video_path,
+					O_RDWR | O_NONBLOCK, 0);
+			if (video_fd < 0)
+				continue;
+
+			test = video_engine_codec_test(video_fd, type);
+
+			close(video_fd);
+
+			if (!test)
+				continue;
+
+			snprintf(decoder->media_path,
+				 sizeof(decoder->media_path), "%s",
+				 media_path);
+			(*decoders_count)++;
+			break;
+		}
+	}
+
+	put_topology(&topology);
+
+	return *decoders_count > count ? 0 : -1;
+}
+
+static int list_decoders(enum codec_type type, struct media_decoder *decoders,
+			 unsigned int decoders_max,
+			 unsigned int *decoders_count)
+{
+	struct dirent *entry;
+	char media_path[128];
+	DIR *directory;
+	int media_fd;
+
+	*decoders_count = 0;
+
+	directory = opendir("/dev");
+	if (directory == NULL) {
+		fprintf(stderr, "Unable to list devices: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	while (*decoders_count < decoders_max &&
+	       (entry = readdir(directory)) != NULL) {
+		if (strncmp(entry->d_name, "media", 5) != 0)
+			continue;
+
+		snprintf(media_path, sizeof(media_path), "/dev/%.64s",
+			 entry->d_name);
+
+		media_fd = open(media_path, O_RDWR | O_NONBLOCK, 0);
+		if (media_fd < 0)
+			continue;
+
+		find_decoders(media_fd, media_path, type, decoders,
+			      decoders_max, decoders_count);
+
+		close(media_fd);
+	}
+
+	closedir(directory);
+
+	return 0;
+}
+
+static char *cache_path(void)
+{
+	char *path = NULL;
+	char *directory;
+
+	directory = getenv("XDG_CACHE_HOME");
+	if (directory != NULL && directory[0] != '\0') {
+		asprintf(&path, "%s/v4l2-request-test-discovery", directory);
+		return path;
+	}
+
+	directory = getenv("HOME");
+	if (directory == NULL)
+		return NULL;
+
+	asprintf(&path, "%s/.cache/v4l2-request-test-discovery", directory);
+
+	return path;
+}
+
+static bool cache_valid(enum codec_type type, bool display,
+			struct media_discovery *discovery)
+{
+	bool test;
+	int video_fd;
+
+	if (access(discovery->media_path, R_OK | W_OK) < 0)
+		return false;
+
+	if (display && access(discovery->drm_path, R_OK | W_OK) < 0)
+		return false;
+
+	/* Device numbering can change across boots. */
+	video_fd = open(discovery->video_path, O_RDWR | O_NONBLOCK, 0);
+	if (video_fd < 0)
+		return false;
+
+	test = video_engine_codec_test(video_fd, type);
+
+	close(video_fd);
+
+	return test;
+}
+
+static int cache_load(const char *path, enum codec_type type,
+		      struct media_discovery *discovery)
+{
+	char name[16];
+	char line[4 * sizeof(discovery->media_path)];
+	FILE *file;
+	int rc = -1;
+
+	file = fopen(path, "r");
+	if (file == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		rc = sscanf(line, "%15s %127s %127s %127s %127s", name,
+			    discovery->media_path, discovery->video_path,
+			    discovery->drm_path, discovery->drm_driver);
+		if (rc == 5 && strcmp(name, codec_name(type)) == 0) {
+			rc = 0;
+			break;
+		}
+
+		rc = -1;
+	}
+
+	fclose(file);
+
+	return rc;
+}
+
+static int cache_store(const char *path, enum codec_type type,
+		       struct media_discovery *discovery)
+{
+	char line[4 * sizeof(discovery->media_path)];
+	char *lines = NULL;
+	size_t lines_size = 0;
+	char name[16];
+	FILE *stream;
+	FILE *file;
+
+	stream = open_memstream(&lines, &lines_size);
+	if (stream == NULL)
+		return -1;
+
+	/* Entries for other codecs are kept as they are. */
+	file = fopen(path, "r");
+	if (file != NULL) {
+		while (fgets(line, sizeof(line), file) != NULL) {
+			if (sscanf(line, "%15s", name) == 1 &&
+			    strcmp(name, codec_name(type)) == 0)
+				continue;
+
+			fputs(line, stream);
+		}
+
+		fclose(file);
+	}
+
+	fprintf(stream, "%s %s %s %s %s\n", codec_name(type),
+		discovery->media_path, discovery->video_path,
+		discovery->drm_path, discovery->drm_driver);
+	fclose(stream);
+
+	file = fopen(path, "w");
+	if (file == NULL) {
+		free(lines);
+		return -1;
+	}
+
+	fwrite(lines, 1, lines_size, file);
+	fclose(file);
+	free(lines);
+
+	return 0;
+}
+
+int media_engine_discover(enum codec_type type, bool display,
+			  struct media_discovery *discovery)
+{
+	struct media_device_info device_info;
+	struct media_decoder decoder;
+	unsigned int decoders_count;
+	char *path = NULL;
+	bool platform = false;
+	int media_fd;
+	int rc;
+
+	memset(discovery, 0, sizeof(*discovery));
+
+	path = cache_path();
+
+	if (path != NULL) {
+		rc = cache_load(path, type, discovery);
+		if (rc == 0 && cache_valid(type, display, discovery)) {
+			discovery->cached = true;
+			free(path);
+			return 0;
+		}
+
+		memset(discovery, 0, sizeof(*discovery));
+	}
+
+	rc = list_decoders(type, &decoder, 1, &decoders_count);
+	if (rc < 0)
+		goto error;
+
+	if (decoders_count == 0) {
+		fprintf(stderr, "Unable to find a %s stateless decoder\n",
+			codec_name(type));
+		goto error;
+	}
+
+	snprintf(discovery->media_path, sizeof(discovery->media_path), "%s",
+		 decoder.media_path);
+	snprintf(discovery->video_path, sizeof(discovery->video_path), "%s",
+		 decoder.video_path);
+
+	media_fd = open(discovery->media_path, O_RDWR | O_NONBLOCK, 0);
+	if (media_fd >= 0) {
+		memset(&device_info, 0, sizeof(device_info));
+
+		rc = ioctl(media_fd, MEDIA_IOC_DEVICE_INFO, &device_info);
+		platform = rc == 0 &&
+			   strncmp(device_info.bus_info, "platform:", 9) == 0;
+
+		close(media_fd);
+	}
+
+	/* Headless runs can do without a display device. */
+	rc = display_engine_discover(platform, discovery->drm_path,
+				     sizeof(discovery->drm_path),
+				     discovery->drm_driver,
+				     sizeof(discovery->drm_driver));
+	if (rc < 0 && display) {
+		goto error;
+	} else if (rc < 0) {
+		snprintf(discovery->drm_path, sizeof(discovery->drm_path),
+			 "none");
+		snprintf(discovery->drm_driver, sizeof(discovery->drm_driver),
+			 "none");
+	}
+
+	if (path != NULL)
+		cache_store(path, type, discovery);
+
+	rc = 0;
+	goto complete;
+
+error:
+	rc = -1;
+
+complete:
+	free(path);
+
+	return rc;
+}
+
+int media_engine_enumerate(enum codec_type type,
+			   struct media_decoder *decoders,
+			   unsigned int decoders_max,
+			   unsigned int *decoders_count)
+{
+	int rc;
+
+	rc = list_decoders(type, decoders, decoders_max, decoders_count);
+	if (rc < 0)
+		return -1;
+
+	if (*decoders_count == 0) {
+		fprintf(stderr, "Unable to find a %s stateless decoder\n",
+			codec_name(type));
+		return -1;
+	}
+
+	return 0;
+}
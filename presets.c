@@ -73,7 +73,6 @@ static struct preset presets[] = {
 		.width = 854,
 		.height = 480,
 		.type = CODEC_TYPE_MPEG2,
-		.buffers_count = 6,
 		.frames = bbb_mpeg2_frames,
 		.frames_count = ARRAY_SIZE(bbb_mpeg2_frames),
 	},
@@ -85,7 +84,6 @@ static struct preset presets[] = {
 		.width = 1080,
 		.height = 1080,
 		.type = CODEC_TYPE_MPEG2,
-		.buffers_count = 6,
 		.frames = bbb_happy_mpeg2_frames,
 		.frames_count = ARRAY_SIZE(bbb_happy_mpeg2_frames),
 	},
@@ -97,7 +95,6 @@ static struct preset presets[] = {
 		.width = 1280,
 		.height = 720,
 		.type = CODEC_TYPE_MPEG2,
-		.buffers_count = 6,
 		.frames = ed_mpeg2_frames,
 		.frames_count = ARRAY_SIZE(ed_mpeg2_frames),
 	},
@@ -110,7 +107,6 @@ static struct preset presets[] = {
 		.width = 854,
 		.height = 480,
 		.type = CODEC_TYPE_H264,
-		.buffers_count = 16,
 		.frames = bbb_h264_all_i_32_frames,
 		.frames_count = ARRAY_SIZE(bbb_h264_all_i_32_frames),
 	},
@@ -122,7 +118,6 @@ static struct preset presets[] = {
 		.width = 854,
 		.height = 480,
 		.type = CODEC_TYPE_H264,
-		.buffers_count = 16,
 		.frames = bbb_h264_high_32_frames,
 		.frames_count = ARRAY_SIZE(bbb_h264_high_32_frames),
 	},
@@ -134,7 +129,6 @@ static struct preset presets[] = {
 		.width = 854,
 		.height = 480,
 		.type = CODEC_TYPE_H264,
-		.buffers_count = 16,
 		.frames = bbb_h264_32_frames,
 		.frames_count = ARRAY_SIZE(bbb_h264_32_frames),
 	},
@@ -148,7 +142,6 @@ static struct preset presets[] = {
 		.width = 640,
 		.height = 360,
 		.type = CODEC_TYPE_H265,
-		.buffers_count = 16,
 		.frames = caminandes_h265_frames,
 		.frames_count = ARRAY_SIZE(caminandes_h265_frames),
 	},
@@ -160,7 +153,6 @@ static struct preset presets[] = {
 		.width = 1280,
 		.height = 720,
 		.type = CODEC_TYPE_H265,
-		.buffers_count = 16,
 		.frames = caminandes_fall_h265_frames,
 		.frames_count = ARRAY_SIZE(caminandes_fall_h265_frames),
 	},
@@ -169,11 +161,6 @@ static struct preset presets[] = {
 
 static unsigned int presets_count = ARRAY_SIZE(presets);
 
-static unsigned int frame_gop_list[64];
-static unsigned int frame_gop_list_size = ARRAY_SIZE(frame_gop_list);
-static unsigned int frame_gop_count = 0;
-static unsigned int frame_gop_start = 0;
-
 void presets_usage(void)
 {
 	struct preset *p;
@@ -201,10 +188,32 @@ struct preset *preset_find(char *name)
 	return NULL;
 }
 
+static int slice_params_copy(void *slice_params, unsigned int size,
+			     const union controls *from, unsigned int from_size)
+{
+	if (from == NULL)
+		return 0;
+
+	if (from_size != size) {
+		fprintf(stderr,
+			"Unexpected slice parameters size %d, expected %d\n",
+			from_size, size);
+		return -1;
+	}
+
+	memcpy(slice_params, from, size);
+
+	return 0;
+}
+
 int frame_controls_fill(struct frame *frame, struct preset *preset,
 			unsigned int buffers_count, unsigned int index,
-			unsigned int slice_size)
+			unsigned int slice_size,
+			const union controls *slice_params,
+			unsigned int slice_params_size)
 {
+	int rc = 0;
+
 	if (frame == NULL || preset == NULL)
 		return -1;
 
@@ -217,7 +226,57 @@ int frame_controls_fill(struct frame *frame, struct preset *preset,
 
 	memcpy(frame, &preset->frames[index], sizeof(*frame));
 
-	return 0;
+	/*
+	 * Each slice of a frame comes with its own size, and with its own
+	 * header when the slice parameters of the frame don't apply.
+	 */
+	switch (preset->type) {
+	case CODEC_TYPE_MPEG2:
+		rc = slice_params_copy(&frame->frame.mpeg2.slice_params,
+				       sizeof(frame->frame.mpeg2.slice_params),
+				       slice_params, slice_params_size);
+		frame->frame.mpeg2.slice_params.bit_size = slice_size * 8;
+		break;
+#ifdef V4L2_PIX_FMT_H264_SLICE
+	case CODEC_TYPE_H264:
+		rc = slice_params_copy(&frame->frame.h264.slice_params,
+				       sizeof(frame->frame.h264.slice_params),
+				       slice_params, slice_params_size);
+		frame->frame.h264.slice_params.size = slice_size;
+		break;
+#endif
+#ifdef V4L2_PIX_FMT_HEVC_SLICE
+	case CODEC_TYPE_H265:
+		rc = slice_params_copy(&frame->frame.h265.slice_params,
+				       sizeof(frame->frame.h265.slice_params),
+				       slice_params, slice_params_size);
+		frame->frame.h265.slice_params.bit_size = slice_size * 8;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	return rc;
+}
+
+unsigned int preset_bit_depth(struct preset *preset)
+{
+	if (preset == NULL || preset->frames_count == 0)
+		return 8;
+
+	switch (preset->type) {
+#ifdef V4L2_PIX_FMT_H264_SLICE
+	case CODEC_TYPE_H264:
+		return preset->frames[0].frame.h264.sps.bit_depth_luma_minus8 + 8;
+#endif
+#ifdef V4L2_PIX_FMT_HEVC_SLICE
+	case CODEC_TYPE_H265:
+		return preset->frames[0].frame.h265.sps.bit_depth_luma_minus8 + 8;
+#endif
+	default:
+		return 8;
+	}
 }
 
 unsigned int frame_pct(struct preset *preset, unsigned int index)
@@ -289,44 +348,104 @@ unsigned int frame_backward_ref_index(struct preset *preset, unsigned int index)
 	}
 }
 
-int frame_gop_next(unsigned int *index)
+unsigned int frame_references(struct preset *preset, unsigned int index,
+			      unsigned int *references)
+{
+	union controls *frame;
+	unsigned int pct;
+	unsigned int count = 0;
+	unsigned int i;
+
+	if (preset == NULL || index >= preset->frames_count)
+		return 0;
+
+	frame = &preset->frames[index].frame;
+	pct = frame_pct(preset, index);
+
+	switch (preset->type) {
+	case CODEC_TYPE_MPEG2:
+		if (pct == PCT_P || pct == PCT_B)
+			references[count++] =
+				INDEX_REF_TS(frame->mpeg2.slice_params.forward_ref_ts);
+
+		if (pct == PCT_B)
+			references[count++] =
+				INDEX_REF_TS(frame->mpeg2.slice_params.backward_ref_ts);
+		break;
+#ifdef V4L2_PIX_FMT_H264_SLICE
+	case CODEC_TYPE_H264:
+		for (i = 0; i < ARRAY_SIZE(frame->h264.decode_params.dpb); i++)
+			if (frame->h264.decode_params.dpb[i].flags &
+			    V4L2_H264_DPB_ENTRY_FLAG_VALID)
+				references[count++] =
+					INDEX_REF_TS(frame->h264.decode_params.dpb[i].reference_ts);
+		break;
+#endif
+#ifdef V4L2_PIX_FMT_HEVC_SLICE
+	case CODEC_TYPE_H265:
+		for (i = 0; i < frame->h265.slice_params.num_active_dpb_entries &&
+			    i < V4L2_HEVC_DPB_ENTRIES_NUM_MAX; i++)
+			references[count++] =
+				INDEX_REF_TS(frame->h265.slice_params.dpb[i].timestamp);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	return count;
+}
+
+void frame_gop_init(struct frame_gop *gop, struct preset *preset)
+{
+	memset(gop, 0, sizeof(*gop));
+
+	/*
+	 * Display count might be lower than frames count due to potentially
+	 * missing predicted frames. Adapt at GOP scheduling time.
+	 */
+	gop->display_count = preset->frames_count;
+}
+
+int frame_gop_next(struct frame_gop *gop, unsigned int *index)
 {
-	if (frame_gop_count == 0)
+	if (gop->count == 0)
 		return -1;
 
 	if (index != NULL)
-		*index = frame_gop_list[frame_gop_start];
+		*index = gop->list[gop->start];
 
 	return 0;
 }
 
-int frame_gop_dequeue(void)
+int frame_gop_dequeue(struct frame_gop *gop)
 {
-	if (frame_gop_count == 0)
+	if (gop->count == 0)
 		return -1;
 
-	frame_gop_start = (frame_gop_start + 1) % frame_gop_list_size;
-	frame_gop_count--;
+	gop->start = (gop->start + 1) % ARRAY_SIZE(gop->list);
+	gop->count--;
 
 	return 0;
 }
 
-int frame_gop_queue(unsigned int index)
+int frame_gop_queue(struct frame_gop *gop, unsigned int index)
 {
 	unsigned int i;
 
-	if (frame_gop_count >= frame_gop_list_size)
+	if (gop->count >= ARRAY_SIZE(gop->list))
 		return -1;
 
-	i = (frame_gop_start + frame_gop_count) % frame_gop_list_size;
-	frame_gop_list[i] = index;
+	i = (gop->start + gop->count) % ARRAY_SIZE(gop->list);
+	gop->list[i] = index;
 
-	frame_gop_count++;
+	gop->count++;
 
 	return 0;
 }
 
-int frame_gop_schedule_ref(struct preset *preset, unsigned int index)
+int frame_gop_schedule_ref(struct frame_gop *gop, struct preset *preset,
+			   unsigned int index)
 {
 	unsigned int gop_start_index;
 	unsigned int pct, pct_next;
@@ -362,7 +481,7 @@ int frame_gop_schedule_ref(struct preset *preset, unsigned int index)
 		} else if (pct == PCT_B) {
 			/* The required backward reference frame is already available, queue now. */
 			if (backward_ref_index >= index)
-				rc |= frame_gop_queue(index);
+				rc |= frame_gop_queue(gop, index);
 
 			/* The B frame was already queued before the associated backward reference frame. */
 			continue;
@@ -378,17 +497,18 @@ int frame_gop_schedule_ref(struct preset *preset, unsigned int index)
 				continue;
 
 			if (backward_ref_index_next == index)
-				rc |= frame_gop_queue(i);
+				rc |= frame_gop_queue(gop, i);
 		}
 
 		/* Queue the non-B frame at this point. */
-		rc |= frame_gop_queue(index);
+		rc |= frame_gop_queue(gop, index);
 	}
 
 	return rc;
 }
 
-int frame_gop_schedule_poc(struct preset *preset, unsigned int index)
+int frame_gop_schedule_poc(struct frame_gop *gop, struct preset *preset,
+			   unsigned int index)
 {
 	unsigned int gop_start_index = index + 1;
 	unsigned int pct;
@@ -402,7 +522,7 @@ int frame_gop_schedule_poc(struct preset *preset, unsigned int index)
 		return 0;
 
 	poc = frame_poc(preset, index);
-	frame_gop_queue(index);
+	frame_gop_queue(gop, index);
 
 	rc = 0;
 
@@ -415,7 +535,7 @@ int frame_gop_schedule_poc(struct preset *preset, unsigned int index)
 
 		poc_next = frame_poc(preset, index);
 		if (poc_next == poc + 1) {
-			rc |= frame_gop_queue(index);
+			rc |= frame_gop_queue(gop, index);
 			poc = poc_next;
 
 			index = gop_start_index;
@@ -426,17 +546,18 @@ int frame_gop_schedule_poc(struct preset *preset, unsigned int index)
 	/* We might be missing predicted frames. */
 	if (index == preset->frames_count &&
 	    index != gop_start_index)
-		preset->display_count = poc + 1;
+		gop->display_count = poc + 1;
 
 	return rc;
 }
 
-int frame_gop_schedule(struct preset *preset, unsigned int index)
+int frame_gop_schedule(struct frame_gop *gop, struct preset *preset,
+		       unsigned int index)
 {
 	switch (preset->type) {
 	case CODEC_TYPE_H265:
-		return frame_gop_schedule_poc(preset, index);
+		return frame_gop_schedule_poc(gop, preset, index);
 	default:
-		return frame_gop_schedule_ref(preset, index);
+		return frame_gop_schedule_ref(gop, preset, index);
 	}
 }
@@ -23,8 +23,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -37,6 +39,12 @@
 
 #include "v4l2-request-test.h"
 
+#define BUFFER_INDEX_NONE	((unsigned int)-1)
+
+/* Event index of a request or video node within a decode context. */
+#define CONTEXT_INDEX(context, index)	(((context) << 16) | (index))
+#define CONTEXT_INDEX_CONTEXT(value)	((value) >> 16)
+
 struct format_description formats[] = {
 	{
 		.description		= "NV12 YUV",
@@ -47,7 +55,54 @@ struct format_description formats[] = {
 		.drm_modifier		= DRM_FORMAT_MOD_NONE,
 		.planes_count		= 2,
 		.bpp			= 16,
+		.depth			= 8,
+	},
+	{
+		.description		= "NV12M YUV",
+		.v4l2_format		= V4L2_PIX_FMT_NV12M,
+		.v4l2_buffers_count	= 2,
+		.v4l2_mplane		= true,
+		.drm_format		= DRM_FORMAT_NV12,
+		.drm_modifier		= DRM_FORMAT_MOD_NONE,
+		.planes_count		= 2,
+		.bpp			= 16,
+		.depth			= 8,
+	},
+	{
+		.description		= "NV16 YUV",
+		.v4l2_format		= V4L2_PIX_FMT_NV16,
+		.v4l2_buffers_count	= 1,
+		.v4l2_mplane		= false,
+		.drm_format		= DRM_FORMAT_NV16,
+		.drm_modifier		= DRM_FORMAT_MOD_NONE,
+		.planes_count		= 2,
+		.bpp			= 16,
+		.depth			= 8,
+	},
+	{
+		.description		= "NV24 YUV",
+		.v4l2_format		= V4L2_PIX_FMT_NV24,
+		.v4l2_buffers_count	= 1,
+		.v4l2_mplane		= false,
+		.drm_format		= DRM_FORMAT_NV24,
+		.drm_modifier		= DRM_FORMAT_MOD_NONE,
+		.planes_count		= 2,
+		.bpp			= 24,
+		.depth			= 8,
+	},
+#if defined(V4L2_PIX_FMT_P010) && defined(DRM_FORMAT_P010)
+	{
+		.description		= "P010 YUV",
+		.v4l2_format		= V4L2_PIX_FMT_P010,
+		.v4l2_buffers_count	= 1,
+		.v4l2_mplane		= false,
+		.drm_format		= DRM_FORMAT_P010,
+		.drm_modifier		= DRM_FORMAT_MOD_NONE,
+		.planes_count		= 2,
+		.bpp			= 24,
+		.depth			= 10,
 	},
+#endif
 #ifdef DRM_FORMAT_MOD_ALLWINNER_TILED
 	{
 		.description		= "Sunxi Tiled NV12 YUV",
@@ -57,11 +112,85 @@ struct format_description formats[] = {
 		.drm_format		= DRM_FORMAT_NV12,
 		.drm_modifier		= DRM_FORMAT_MOD_ALLWINNER_TILED,
 		.planes_count		= 2,
-		.bpp			= 16
+		.bpp			= 16,
+		.depth			= 8,
 	},
 #endif
 };
 
+/* The drm memory type is DMABUF allocated from the display device. */
+static struct {
+	char *name;
+	unsigned int memory;
+	bool drm;
+} memories[] = {
+	{ "mmap", V4L2_MEMORY_MMAP, false },
+	{ "userptr", V4L2_MEMORY_USERPTR, false },
+	{ "dmabuf", V4L2_MEMORY_DMABUF, false },
+	{ "drm", V4L2_MEMORY_DMABUF, true },
+};
+
+static int memory_find(const char *name, unsigned int *memory, bool *drm)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(memories); i++) {
+		if (strcmp(memories[i].name, name) == 0) {
+			*memory = memories[i].memory;
+			*drm = memories[i].drm;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static char *memory_name(unsigned int memory, bool drm)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(memories); i++)
+		if (memories[i].memory == memory && memories[i].drm == drm)
+			return memories[i].name;
+
+	return "invalid";
+}
+
+/*
+ * Rank destination formats by the frame size the driver reports, which
+ * accounts for its own padding and compression. Between equal sizes, prefer
+ * tiled or compressed layouts, which the decoder writes natively.
+ */
+static bool format_better(struct format_description *format, unsigned int size,
+			  struct format_description *selected,
+			  unsigned int selected_size)
+{
+	if (selected == NULL || size < selected_size)
+		return true;
+
+	if (size > selected_size)
+		return false;
+
+	return format->drm_modifier != DRM_FORMAT_MOD_LINEAR &&
+	       selected->drm_modifier == DRM_FORMAT_MOD_LINEAR;
+}
+
+static char *sink_name(struct config *config)
+{
+	switch (config->sink) {
+	case SINK_TYPE_DISPLAY:
+		return "display";
+	case SINK_TYPE_DISCARD:
+		return "discard";
+	case SINK_TYPE_CHECKSUM:
+		return "checksum";
+	case SINK_TYPE_FILE:
+		return config->sink_path;
+	default:
+		return "invalid";
+	}
+}
+
 static void print_help(void)
 {
 	printf("Usage: v4l2-request-test [OPTIONS] [SLICES PATH]\n\n"
@@ -70,9 +199,23 @@ static void print_help(void)
 	       " -m [media path]                path for the media node\n"
 	       " -d [DRM path]                  path for the DRM node\n"
 	       " -D [DRM driver]                DRM driver to use\n"
+	       " -A                             discover video, media and DRM nodes\n"
 	       " -s [slices filename format]    format for filenames in the slices path\n"
+	       " -M                             frames made of multiple slices (slice-%%d-%%d.dump)\n"
+	       "                                with their headers (slice-%%d-%%d.params)\n"
 	       " -f [fps]                       number of frames to display per second\n"
+	       " -o [sink]                      frames sink (display, discard, checksum or file path)\n"
 	       " -P [video preset]              video preset to use\n"
+	       " -p [pipeline depth]            number of decode requests in flight\n"
+	       " -n [count]                     number of concurrent decode contexts\n"
+	       " -L                             dispatch contexts across all compatible decoders\n"
+	       " -S [count]                     initial number of source buffers\n"
+	       " -B [count]                     initial number of destination buffers\n"
+	       " -O [memory]                    source memory type (mmap, userptr or dmabuf)\n"
+	       " -C [memory]                    destination memory type (mmap, userptr, dmabuf or drm)\n"
+	       " -b                             benchmark all memory types combinations\n"
+	       " -c                             only send stream controls when they change\n"
+	       " -H                             use cache hints with non-coherent mmap buffers\n"
 	       " -i                             enable interactive mode\n"
 	       " -l                             loop preset frames\n"
 	       " -q                             enable quiet mode\n"
@@ -91,165 +234,1853 @@ static void print_summary(struct config *config, struct preset *preset)
 	printf(" DRM driver: %s\n", config->drm_driver);
 	printf(" Slices path: %s\n", config->slices_path);
 	printf(" Slices filename format: %s\n", config->slices_filename_format);
-	printf(" FPS: %d\n\n", config->fps);
+	printf(" Multi-slice frames: %s\n", config->multi_slice ? "yes" : "no");
+	printf(" Sink: %s\n", sink_name(config));
+	printf(" FPS: %d\n", config->fps);
+	printf(" Pipeline depth: %d\n", config->pipeline_depth);
+	printf(" Decode contexts: %d\n", config->contexts_count);
+	printf(" Dispatch to all decoders: %s\n",
+	       config->dispatch ? "yes" : "no");
+	printf(" Source buffers: %d\n", config->sources_count);
+	printf(" Destination buffers: %d\n", config->buffers_count);
+	printf(" Source memory: %s\n",
+	       memory_name(config->source_memory, false));
+	printf(" Destination memory: %s\n",
+	       memory_name(config->destination_memory,
+			   config->destination_drm));
+	printf(" Delta controls: %s\n",
+	       config->controls_delta ? "yes" : "no");
+	printf(" Cache hints: %s\n\n", config->cache_hints ? "yes" : "no");
+
+	printf("Preset:\n");
+	printf(" Name: %s\n", preset->name);
+	printf(" Description: %s\n", preset->description);
+	printf(" License: %s\n", preset->license);
+	printf(" Attribution: %s\n", preset->attribution);
+	printf(" Width: %d\n", preset->width);
+	printf(" Height: %d\n", preset->height);
+	printf(" Frames count: %d\n", preset->frames_count);
+
+	printf(" Format: ");
+
+	switch (preset->type) {
+	case CODEC_TYPE_MPEG2:
+		printf("MPEG2");
+		break;
+	case CODEC_TYPE_H264:
+		printf("H264");
+		break;
+	case CODEC_TYPE_H265:
+		printf("H265");
+		break;
+	default:
+		printf("Invalid");
+		break;
+	}
+
+	printf("\n\n");
+}
+
+static long time_diff(struct timespec *before, struct timespec *after)
+{
+	long before_time = before->tv_sec * 1000000 + before->tv_nsec / 1000;
+	long after_time = after->tv_sec * 1000000 + after->tv_nsec / 1000;
+
+	return (after_time - before_time);
+}
+
+static void print_time_diff(struct timespec *before, struct timespec *after,
+			    const char *prefix)
+{
+	long diff = time_diff(before, after);
+	printf("%s time: %ld us\n", prefix, diff);
+}
+
+static int event_add(int epoll_fd, int fd, unsigned int events,
+		     uint64_t data)
+{
+	struct epoll_event event;
+	int rc;
+
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.u64 = data;
+
+	rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to add fd %d to epoll: %s\n", fd,
+			strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int event_remove(int epoll_fd, int fd)
+{
+	int rc;
+
+	rc = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to remove fd %d from epoll: %s\n", fd,
+			strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int load_data(const char *path, void *data, unsigned int data_size,
+		     unsigned int *size)
+{
+	unsigned int length;
+	unsigned int offset;
+	struct stat st;
+	int fd = -1;
+	int rc;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open file path: %s\n",
+			strerror(errno));
+		goto error;
+	}
+
+	rc = fstat(fd, &st);
+	if (rc < 0) {
+		fprintf(stderr, "Stating file failed\n");
+		goto error;
+	}
+
+	length = st.st_size;
+
+	if (length > data_size) {
+		fprintf(stderr, "File size %d exceeds buffer size %d\n",
+			length, data_size);
+		goto error;
+	}
+
+	/* Read straight into the destination, without intermediate copy. */
+	for (offset = 0; offset < length; offset += rc) {
+		rc = read(fd, (unsigned char *)data + offset, length - offset);
+		if (rc < 0) {
+			fprintf(stderr, "Unable to read file data: %s\n",
+				strerror(errno));
+			goto error;
+		} else if (rc == 0) {
+			fprintf(stderr, "Unexpected end of file data\n");
+			goto error;
+		}
+	}
+
+	*size = length;
+
+	rc = 0;
+	goto complete;
+
+error:
+	rc = -1;
+
+complete:
+	if (fd >= 0)
+		close(fd);
+
+	return rc;
+}
+
+static const unsigned char start_code_bytes[] = { 0x00, 0x00, 0x01 };
+
+static int load_slices(struct config *config, unsigned int index,
+		       unsigned int first, unsigned int count, bool start_code,
+		       void *data, unsigned int data_size, unsigned int *size)
+{
+	char *slice_filename = NULL;
+	char *slice_path = NULL;
+	unsigned int offset = 0;
+	unsigned int length;
+	unsigned int i;
+	int rc;
+
+	/* Frame-based requests carry all the slices of the frame. */
+	for (i = first; i < first + count; i++) {
+		if (start_code) {
+			if (offset + sizeof(start_code_bytes) > data_size) {
+				fprintf(stderr, "Slice data exceeds buffer size %d\n",
+					data_size);
+				return -1;
+			}
+
+			memcpy((unsigned char *)data + offset,
+			       start_code_bytes, sizeof(start_code_bytes));
+			offset += sizeof(start_code_bytes);
+		}
+
+		asprintf(&slice_filename, config->slices_filename_format,
+			 index, i);
+		asprintf(&slice_path, "%s/%s", config->slices_path,
+			 slice_filename);
+
+		rc = load_data(slice_path, (unsigned char *)data + offset,
+			       data_size - offset, &length);
+
+		free(slice_filename);
+		free(slice_path);
+
+		if (rc < 0)
+			return -1;
+
+		offset += length;
+	}
+
+	*size = offset;
+
+	return 0;
+}
+
+/*
+ * Slice parameters files hold the slice parameters control of the codec,
+ * with the same layout as in the preset frames.
+ */
+static int load_slice_params(struct config *config, unsigned int index,
+			     unsigned int slice, union controls *slice_params,
+			     unsigned int *size)
+{
+	char *params_filename = NULL;
+	char *params_path = NULL;
+	int rc;
+
+	asprintf(&params_filename, config->slice_params_filename_format,
+		 index, slice);
+	asprintf(&params_path, "%s/%s", config->slices_path, params_filename);
+
+	rc = load_data(params_path, slice_params, sizeof(*slice_params), size);
+
+	free(params_filename);
+	free(params_path);
+
+	return rc;
+}
+
+static int slices_count_probe(struct config *config, unsigned int index,
+			      unsigned int *count)
+{
+	char *slice_filename = NULL;
+	char *slice_path = NULL;
+	unsigned int i;
+	int rc;
+
+	if (!config->multi_slice) {
+		*count = 1;
+		return 0;
+	}
+
+	/* Slices of a frame are numbered from zero without gaps. */
+	for (i = 0; ; i++) {
+		asprintf(&slice_filename, config->slices_filename_format,
+			 index, i);
+		asprintf(&slice_path, "%s/%s", config->slices_path,
+			 slice_filename);
+
+		rc = access(slice_path, R_OK);
+
+		free(slice_filename);
+		free(slice_path);
+
+		if (rc < 0)
+			break;
+	}
+
+	if (i == 0)
+		return -1;
+
+	*count = i;
+
+	return 0;
+}
+
+static int slices_size_probe(struct config *config, struct preset *preset,
+			     unsigned int *slice_size_max,
+			     unsigned int *frame_size_max)
+{
+	char *slice_filename = NULL;
+	char *slice_path = NULL;
+	unsigned int slices_count;
+	unsigned int frame_size;
+	unsigned int slice_size;
+	struct stat st;
+	unsigned int i, j;
+	int rc;
+
+	*slice_size_max = 0;
+	*frame_size_max = 0;
+
+	config->slice_params = true;
+
+	for (i = 0; i < preset->frames_count; i++) {
+		rc = slices_count_probe(config, i, &slices_count);
+		if (rc < 0) {
+			fprintf(stderr, "Unable to find slices for frame %d\n",
+				i);
+			return -1;
+		}
+
+		frame_size = 0;
+
+		for (j = 0; j < slices_count; j++) {
+			asprintf(&slice_filename, config->slices_filename_format,
+				 i, j);
+			asprintf(&slice_path, "%s/%s", config->slices_path,
+				 slice_filename);
+
+			rc = stat(slice_path, &st);
+
+			free(slice_filename);
+			free(slice_path);
+
+			if (rc < 0) {
+				fprintf(stderr,
+					"Unable to stat slice %d of frame %d: %s\n",
+					j, i, strerror(errno));
+				return -1;
+			}
+
+			/* Leave room for a start code, should one be needed. */
+			slice_size = st.st_size + sizeof(start_code_bytes);
+			frame_size += slice_size;
+
+			if (slice_size > *slice_size_max)
+				*slice_size_max = slice_size;
+
+			/* Frame parameters are enough for single slices. */
+			if (slices_count == 1)
+				continue;
+
+			asprintf(&slice_filename,
+				 config->slice_params_filename_format, i, j);
+			asprintf(&slice_path, "%s/%s", config->slices_path,
+				 slice_filename);
+
+			if (access(slice_path, R_OK) < 0)
+				config->slice_params = false;
+
+			free(slice_filename);
+			free(slice_path);
+		}
+
+		if (frame_size > *frame_size_max)
+			*frame_size_max = frame_size;
+	}
+
+	return 0;
+}
+
+/*
+ * A buffer is available once its frame was displayed and every frame
+ * referencing it was decoded.
+ */
+static bool buffer_available(struct video_buffer *buffers,
+			     unsigned int buffers_count, unsigned int index,
+			     unsigned int *last_use, unsigned int decode_index)
+{
+	unsigned int frame_index;
+	unsigned int i;
+
+	if (buffers[index].state == VIDEO_BUFFER_STATE_FREE)
+		return true;
+
+	if (buffers[index].state != VIDEO_BUFFER_STATE_DISPLAYED)
+		return false;
+
+	frame_index = INDEX_REF_TS(buffers[index].ts);
+
+	if (last_use[frame_index] >= decode_index)
+		return false;
+
+	for (i = 0; i < buffers_count; i++)
+		if (buffers[i].state == VIDEO_BUFFER_STATE_PENDING &&
+		    INDEX_REF_TS(buffers[i].ts) <= last_use[frame_index])
+			return false;
+
+	return true;
+}
+
+/* Find the last frame in decode order referencing each frame. */
+static int frame_last_use_create(struct preset *preset,
+				 unsigned int **last_use)
+{
+	unsigned int references[FRAME_REFERENCES_MAX];
+	unsigned int references_count;
+	unsigned int *frames_last_use;
+	unsigned int i, j;
+
+	frames_last_use = malloc(preset->frames_count *
+				 sizeof(*frames_last_use));
+	if (frames_last_use == NULL) {
+		fprintf(stderr, "Unable to allocate frame references\n");
+		return -1;
+	}
+
+	for (i = 0; i < preset->frames_count; i++) {
+		frames_last_use[i] = i;
+
+		references_count = frame_references(preset, i, references);
+
+		for (j = 0; j < references_count; j++)
+			if (references[j] < i &&
+			    frames_last_use[references[j]] < i)
+				frames_last_use[references[j]] = i;
+	}
+
+	*last_use = frames_last_use;
+
+	return 0;
+}
+
+/*
+ * Frames go to the available buffer that was assigned the longest ago,
+ * except for the ones being shown or flipped to. The buffers count is
+ * returned when none is available.
+ */
+static unsigned int buffer_select(struct decode_context *context)
+{
+	struct video_buffer *buffers = context->video_buffers;
+	unsigned int selected = context->buffers_count;
+	unsigned int buffers_busy = 0;
+	unsigned int i;
+
+	for (i = 0; i < context->buffers_count; i++) {
+		if (i == context->shown_index || i == context->flip_index ||
+		    !buffer_available(buffers, context->buffers_count, i,
+				      context->last_use,
+				      context->decode_index)) {
+			buffers_busy++;
+			continue;
+		}
+
+		if (selected == context->buffers_count ||
+		    buffers[i].serial < buffers[selected].serial)
+			selected = i;
+	}
+
+	if (buffers_busy + 1 > context->stats.buffers_needed)
+		context->stats.buffers_needed = buffers_busy + 1;
+
+	return selected;
+}
+
+static void setup_config(struct config *config)
+{
+	memset(config, 0, sizeof(*config));
+
+	config->video_path = strdup("/dev/video0");
+	config->media_path = strdup("/dev/media0");
+	config->drm_path = strdup("/dev/dri/card0");
+	config->drm_driver = strdup("sun4i-drm");
+
+	config->preset_name = strdup("bbb-mpeg2");
+	config->slices_filename_format = strdup("slice-%d.dump");
+	config->slice_params_filename_format = NULL;
+
+	config->sink = SINK_TYPE_DISPLAY;
+	config->sink_path = NULL;
+
+	config->buffers_count = 0;
+	config->sources_count = 0;
+	config->pipeline_depth = 1;
+	config->source_memory = V4L2_MEMORY_MMAP;
+	config->destination_memory = V4L2_MEMORY_MMAP;
+	config->destination_drm = false;
+	config->multi_slice = false;
+	config->controls_delta = false;
+	config->cache_hints = false;
+	config->discover = false;
+	config->contexts_count = 1;
+	config->dispatch = false;
+	config->fps = 0;
+	config->benchmark = false;
+	config->quiet = false;
+	config->interactive = false;
+	config->loop = false;
+}
+
+static void cleanup_config(struct config *config)
+{
+	free(config->video_path);
+	free(config->media_path);
+	free(config->drm_path);
+	free(config->drm_driver);
+
+	free(config->preset_name);
+	free(config->slices_path);
+	free(config->slices_filename_format);
+	free(config->slice_params_filename_format);
+	free(config->sink_path);
+}
+
+/*
+ * Only visible lines and bytes are consumed, since padding contents are left
+ * undefined by drivers. Tiled layouts are consumed as a whole. Frames of
+ * concurrent decode contexts are told apart by their context, or -1 when
+ * there is a single one.
+ */
+static int frame_sink(struct config *config, FILE *file,
+		      struct format_description *format,
+		      struct video_buffer *buffer, unsigned int width,
+		      unsigned int height, int context, unsigned int index)
+{
+	unsigned char *data;
+	unsigned int bytes, lines;
+	unsigned int checksum = 2166136261U;
+	unsigned int i, j, k;
+	size_t count;
+
+	for (i = 0; i < buffer->destination_planes_count; i++) {
+		data = buffer->destination_data[i];
+
+		if (format->drm_modifier != DRM_FORMAT_MOD_LINEAR) {
+			bytes = buffer->destination_sizes[i];
+			lines = 1;
+		} else {
+			bytes = width * (format->depth > 8 ? 2 : 1) *
+				buffer->destination_bytesperlines[i] /
+				buffer->destination_bytesperlines[0];
+			lines = height * buffer->destination_heights[i] /
+				buffer->destination_heights[0];
+		}
+
+		for (j = 0; j < lines; j++) {
+			if (config->sink == SINK_TYPE_CHECKSUM) {
+				/* FNV-1a */
+				for (k = 0; k < bytes; k++)
+					checksum = (checksum ^ data[k]) *
+						   16777619U;
+			} else if (config->sink == SINK_TYPE_FILE) {
+				count = fwrite(data, 1, bytes, file);
+				if (count != bytes) {
+					fprintf(stderr,
+						"Unable to write frame %d: %s\n",
+						index, strerror(errno));
+					return -1;
+				}
+			}
+
+			data += buffer->destination_bytesperlines[i];
+		}
+	}
+
+	if (config->sink == SINK_TYPE_CHECKSUM && context >= 0)
+		printf("Context %d frame %d checksum: %08x\n", context, index,
+		       checksum);
+	else if (config->sink == SINK_TYPE_CHECKSUM)
+		printf("Frame %d checksum: %08x\n", index, checksum);
+
+	return 0;
+}
+
+/* A device is busy as long as at least one request is queued to it. */
+static void device_queue_update(struct decode_device *device, bool queued)
+{
+	struct timespec busy_time_after;
+
+	if (queued) {
+		if (device->queued_count == 0)
+			clock_gettime(CLOCK_MONOTONIC,
+				      &device->busy_time_before);
+
+		device->queued_count++;
+
+		if (device->queued_count > device->queued_max)
+			device->queued_max = device->queued_count;
+
+		return;
+	}
+
+	device->queued_count--;
+
+	if (device->queued_count == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &busy_time_after);
+		device->busy_time += time_diff(&device->busy_time_before,
+					       &busy_time_after);
+	}
+}
+
+static void stats_account(struct decode_stats *stats, long decode_time,
+			  long hardware_time, long userspace_time)
+{
+	if (stats->frames_count == 0 || decode_time < stats->decode_time_min)
+		stats->decode_time_min = decode_time;
+
+	if (decode_time > stats->decode_time_max)
+		stats->decode_time_max = decode_time;
+
+	stats->decode_time += decode_time;
+	stats->hardware_time += hardware_time;
+	stats->userspace_time += userspace_time;
+	stats->frames_count++;
+}
+
+/*
+ * Queue the next request of a context, with one slice or the rest of the
+ * frame. The source pool grows when it runs out and so does the destination
+ * pool, up to its maximum size, after which 1 is returned. Requests are only
+ * accounted to a device when there is one.
+ */
+static int context_queue(struct config *config, struct preset *preset,
+			 struct decode_device *device,
+			 struct decode_context *context, unsigned int index,
+			 int epoll_fd)
+{
+	struct video_setup *setup = &context->video_setup;
+	struct frame frame;
+	union controls slice_params;
+	unsigned int source_index;
+	unsigned int request_index;
+	unsigned int request_slices;
+	unsigned int slice_size;
+	unsigned int slice_params_size = 0;
+	unsigned int v4l2_index;
+	bool slice_headers;
+	uint64_t ts;
+	int rc;
+
+	for (source_index = 0; source_index < setup->sources_count;
+	     source_index++)
+		if (!setup->sources[source_index].pending)
+			break;
+
+	if (source_index == setup->sources_count) {
+		rc = video_engine_sources_grow(context->video_fd, 1, setup);
+		if (rc < 0)
+			return -1;
+
+		if (context->verbose)
+			printf("Grew source buffers to %d\n",
+			       setup->sources_count);
+	}
+
+	if (context->slice_index == 0) {
+		v4l2_index = buffer_select(context);
+
+		if (v4l2_index == context->buffers_count) {
+			if (context->buffers_count >= VIDEO_MAX_FRAME)
+				return 1;
+
+			rc = video_engine_buffers_grow(context->video_fd,
+						       &context->video_buffers,
+						       &context->buffers_count,
+						       1, setup);
+			if (rc < 0)
+				return -1;
+
+			v4l2_index = context->buffers_count - 1;
+
+			if (context->verbose)
+				printf("Grew destination buffers to %d\n",
+				       context->buffers_count);
+		}
+
+		rc = slices_count_probe(config, context->decode_index,
+					&context->slices_count);
+		if (rc < 0) {
+			fprintf(stderr, "Unable to find slices for frame %d\n",
+				context->decode_index);
+			return -1;
+		}
+
+		if (context->verbose)
+			printf("\nProcessing frame %d/%d\n",
+			       context->decode_index + 1, preset->frames_count);
+
+		rc = frame_gop_schedule(&context->gop, preset,
+					context->decode_index);
+		if (rc < 0) {
+			fprintf(stderr, "Unable to schedule GOP frames order\n");
+			return -1;
+		}
+
+		context->destination_index = v4l2_index;
+		context->video_buffers[v4l2_index].serial = ++context->serial;
+		context->frame_slots[context->decode_index] = v4l2_index;
+
+		clock_gettime(CLOCK_MONOTONIC,
+			      &context->video_before[context->decode_index]);
+	}
+
+	request_slices = setup->frame_based ?
+			 context->slices_count - context->slice_index : 1;
+
+	rc = video_engine_source_access(source_index, setup);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to access source data\n");
+		return -1;
+	}
+
+	rc = load_slices(config, context->decode_index, context->slice_index,
+			 request_slices, setup->start_code,
+			 setup->sources[source_index].data,
+			 setup->sources[source_index].size, &slice_size);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to load slice data\n");
+		return -1;
+	}
+
+	if (context->verbose && request_slices > 1)
+		printf("Loaded %d bytes of video slices %d-%d/%d data\n",
+		       slice_size, context->slice_index + 1,
+		       context->slice_index + request_slices,
+		       context->slices_count);
+	else if (context->verbose)
+		printf("Loaded %d bytes of video slice %d/%d data\n",
+		       slice_size, context->slice_index + 1,
+		       context->slices_count);
+
+	slice_headers = !setup->frame_based && context->slices_count > 1;
+
+	if (slice_headers) {
+		rc = load_slice_params(config, context->decode_index,
+				       context->slice_index, &slice_params,
+				       &slice_params_size);
+		if (rc < 0) {
+			fprintf(stderr, "Unable to load slice parameters\n");
+			return -1;
+		}
+	}
+
+	rc = frame_controls_fill(&frame, preset, context->buffers_count,
+				 context->decode_index, slice_size,
+				 slice_headers ? &slice_params : NULL,
+				 slice_params_size);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to fill frame controls\n");
+		return -1;
+	}
+
+	ts = TS_REF_INDEX(context->decode_index);
+
+	rc = video_engine_queue(context->video_fd, source_index,
+				context->destination_index, &frame.frame,
+				preset->type, ts, slice_size,
+				context->slice_index + request_slices <
+					context->slices_count,
+				context->video_buffers, setup);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to queue video slice\n");
+		return -1;
+	}
+
+	request_index = setup->sources[source_index].request_index;
+
+	rc = event_add(epoll_fd, setup->requests[request_index].fd, EPOLLPRI,
+		       EVENT_DATA(EVENT_TYPE_REQUEST,
+				  CONTEXT_INDEX(index, request_index)));
+	if (rc < 0)
+		return -1;
+
+	context->queued_count++;
+
+	if (device != NULL)
+		device_queue_update(device, true);
+
+	context->slice_index += request_slices;
+
+	if (context->slice_index == context->slices_count) {
+		context->slice_index = 0;
+		context->decode_index++;
+	}
+
+	return 0;
+}
+
+/*
+ * Start the video engine of a context on its already opened video node.
+ * Decoded frames are only mapped when the sink reads them, which display
+ * setup may restrict further.
+ */
+static int context_start(struct config *config, struct preset *preset,
+			 struct format_description *format, int media_fd,
+			 struct decode_context *context)
+{
+	struct video_setup *setup = &context->video_setup;
+	unsigned int i;
+	int rc;
+
+	setup->source_memory = config->source_memory;
+	setup->destination_memory = config->destination_memory;
+	setup->drm_fd = config->destination_drm ? context->drm_fd : -1;
+	setup->controls_delta = config->controls_delta;
+	setup->cache_hints = config->cache_hints;
+	setup->slice_size_max = config->slice_size_max;
+	setup->frame_size_max = config->frame_size_max;
+	setup->destination_cpu_access = config->sink != SINK_TYPE_DISCARD;
+
+	context->buffers_count = config->buffers_count;
+	context->width = preset->width;
+	context->height = preset->height;
+	context->shown_index = BUFFER_INDEX_NONE;
+	context->flip_index = BUFFER_INDEX_NONE;
+
+	rc = video_engine_start(context->video_fd, media_fd, preset->width,
+				preset->height, format, preset->type,
+				&context->video_buffers, config->buffers_count,
+				config->sources_count, setup);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to start video engine\n");
+		return -1;
+	}
+
+	/* Catch unsupported payloads before the first frame is queued. */
+	for (i = 0; i < preset->frames_count; i++) {
+		rc = video_engine_controls_test(context->video_fd,
+						&preset->frames[i].frame,
+						setup);
+		if (rc < 0) {
+			fprintf(stderr, "Unable to validate frame %d controls\n",
+				i);
+			return -1;
+		}
+	}
+
+	if (config->multi_slice && !setup->frame_based &&
+	    !setup->hold_capture) {
+		fprintf(stderr,
+			"Missing required destination buffer hold capability\n");
+		return -1;
+	}
+
+	/* Slice-based decoders need the header of each slice. */
+	if (config->multi_slice && !setup->frame_based &&
+	    !config->slice_params) {
+		fprintf(stderr,
+			"Missing slice parameters for slice-based decoding\n");
+		return -1;
+	}
+
+	if (context->verbose)
+		printf("Source buffers size: %d bytes (driver default %d), %ld bytes saved over %d buffers\n",
+		       setup->source_size, setup->source_size_default,
+		       ((long)setup->source_size_default -
+			setup->source_size) * setup->sources_count,
+		       setup->sources_count);
+
+	if (context->verbose && config->cache_hints)
+		printf("Non-coherent buffers: source %s, destination %s\n",
+		       setup->source_non_coherent ? "yes" : "no",
+		       setup->destination_non_coherent ? "yes" : "no");
+
+	context->video_before = malloc(preset->frames_count *
+				       sizeof(*context->video_before));
+	if (context->video_before == NULL) {
+		fprintf(stderr, "Unable to allocate decode timestamps\n");
+		return -1;
+	}
+
+	context->frame_slots = malloc(preset->frames_count *
+				      sizeof(*context->frame_slots));
+	if (context->frame_slots == NULL) {
+		fprintf(stderr, "Unable to allocate frame slots\n");
+		return -1;
+	}
+
+	context->slices_count = 1;
+
+	frame_gop_init(&context->gop, preset);
+
+	clock_gettime(CLOCK_MONOTONIC, &context->start_time);
+
+	return 0;
+}
+
+/* The video node is left to whoever opened it. */
+static void context_stop(struct decode_context *context)
+{
+	if (context->video_buffers != NULL)
+		video_engine_stop(context->video_fd, context->video_buffers,
+				  context->buffers_count,
+				  &context->video_setup);
+
+	if (context->video_before != NULL)
+		free(context->video_before);
+
+	if (context->frame_slots != NULL)
+		free(context->frame_slots);
+}
+
+/*
+ * Hand every decoded frame that is next in display order to the sink, as
+ * long as display credits are left when paced. Frames shown on the display
+ * go one at a time, until their page flip completes.
+ */
+static int context_display(struct config *config,
+			   struct format_description *format,
+			   struct decode_context *context, int index,
+			   unsigned int *credits)
+{
+	struct display_setup *display_setup = &context->display_setup;
+	struct video_buffer *buffer;
+	unsigned int display_index;
+	unsigned int v4l2_index;
+	int rc;
+
+	while (context->display_count < context->gop.display_count &&
+	       !display_setup->flip_pending &&
+	       (credits == NULL || *credits > 0)) {
+		rc = frame_gop_next(&context->gop, &display_index);
+		if (rc < 0 || display_index >= context->decode_index)
+			break;
+
+		v4l2_index = context->frame_slots[display_index];
+		buffer = &context->video_buffers[v4l2_index];
+		if (buffer->state != VIDEO_BUFFER_STATE_DECODED)
+			break;
+
+		rc = frame_gop_dequeue(&context->gop);
+		if (rc < 0) {
+			fprintf(stderr,
+				"Unable to dequeue next GOP frame index for display\n");
+			return -1;
+		}
+
+		/* Only copies need a mapping. */
+		if (config->sink != SINK_TYPE_DISCARD &&
+		    !display_setup->use_dmabuf) {
+			rc = video_engine_buffer_map(context->video_fd, buffer,
+						     &context->video_setup);
+			if (rc < 0)
+				return -1;
+		}
+
+		if (config->sink == SINK_TYPE_DISPLAY) {
+			clock_gettime(CLOCK_MONOTONIC,
+				      &context->display_before);
+
+			rc = display_engine_show(context->drm_fd, v4l2_index,
+						 context->video_buffers,
+						 context->gem_buffers,
+						 display_setup);
+			if (rc < 0) {
+				fprintf(stderr,
+					"Unable to display video frame\n");
+				return -1;
+			}
+
+			context->flip_index = v4l2_index;
+		} else {
+			rc = frame_sink(config, context->sink_file, format,
+					buffer, context->width,
+					context->height, index,
+					display_index);
+			if (rc < 0)
+				return -1;
+		}
+
+		buffer->state = VIDEO_BUFFER_STATE_DISPLAYED;
+		context->display_count++;
+
+		if (credits != NULL)
+			(*credits)--;
+	}
+
+	return 0;
+}
+
+/*
+ * Complete the next request returned by the driver, whichever request woke
+ * the caller up. Other signalled requests are left for the next events.
+ * Requests are only accounted to a device when there is one. A single
+ * context reports each frame in detail when verbose.
+ */
+static int context_complete(struct config *config,
+			    struct decode_device *device,
+			    struct decode_context *context, unsigned int index,
+			    int epoll_fd)
+{
+	struct video_buffer *buffer;
+	struct timespec video_after;
+	unsigned int frame_index;
+	unsigned int v4l2_index;
+	long decode_time;
+	long hardware_time;
+	long userspace_time;
+	int request_fd;
+	int rc;
+
+	rc = video_engine_complete(context->video_fd, context->video_buffers,
+				   context->buffers_count,
+				   &context->video_setup, &v4l2_index,
+				   &request_fd);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to decode video frame\n");
+		return -1;
+	}
+
+	rc = event_remove(epoll_fd, request_fd);
+	if (rc < 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &video_after);
+
+	context->queued_count--;
+	context->stats.slices_count++;
+
+	if (device != NULL) {
+		device_queue_update(device, false);
+		device->stats.slices_count++;
+	}
+
+	/* Wait for the last slice of the frame. */
+	buffer = &context->video_buffers[v4l2_index];
+	if (buffer->state != VIDEO_BUFFER_STATE_DECODED)
+		return 0;
+
+	frame_index = INDEX_REF_TS(buffer->ts);
+	decode_time = time_diff(&context->video_before[frame_index],
+				&video_after);
+
+	/*
+	 * Hardware time spans from queueing the first slice to waking up for
+	 * the last one, the rest is spent preparing and completing requests.
+	 */
+	hardware_time = time_diff(&buffer->queue_time, &buffer->wakeup_time);
+	userspace_time = time_diff(&context->video_before[frame_index],
+				   &buffer->queue_time) +
+			 time_diff(&buffer->wakeup_time, &buffer->dequeue_time);
+
+	stats_account(&context->stats, decode_time, hardware_time,
+		      userspace_time);
+
+	if (device != NULL)
+		stats_account(&device->stats, decode_time, hardware_time,
+			      userspace_time);
+
+	if (context->verbose) {
+		printf("Decoded video frame %d successfuly!\n", frame_index);
+		print_time_diff(&context->video_before[frame_index],
+				&video_after, "Frame decode");
+		printf("Frame sequence %d: %ld us hardware, %ld us userspace\n",
+		       buffer->sequence, hardware_time, userspace_time);
+	} else if (!config->quiet && device != NULL) {
+		printf("Context %d decoded video frame %d in %ld us on %s\n",
+		       index, frame_index, decode_time,
+		       device->decoder.video_path);
+	}
+
+	return 0;
+}
+
+/*
+ * Memory types that the driver refuses to allocate or queue make the run
+ * fail with -EOPNOTSUPP, any other error with -1.
+ */
+static int decode_preset(struct config *config, struct preset *preset,
+			 struct format_description *format, int video_fd,
+			 int media_fd, int drm_fd, struct decode_stats *stats)
+{
+	struct decode_context context;
+	struct video_setup *setup = &context.video_setup;
+	struct display_setup *display_setup = &context.display_setup;
+	struct epoll_event events[8];
+	struct itimerspec timer_spec;
+	struct timespec display_after;
+	struct timespec wall_before, wall_after;
+	struct timespec cpu_before, cpu_after;
+	unsigned int buffers_count;
+	unsigned int display_index;
+	unsigned int display_count;
+	unsigned int display_credits;
+	unsigned int event_type;
+	unsigned int event_changes;
+	unsigned int i, j;
+	uint64_t expirations;
+	uint64_t period;
+	char input[64];
+	bool display_paced;
+	bool resize_pending = false;
+	int events_count;
+	int epoll_fd = -1;
+	int timer_fd = -1;
+	int rc;
+
+	if (stats != NULL)
+		memset(stats, 0, sizeof(*stats));
+
+	memset(&context, 0, sizeof(context));
+
+	context.video_fd = video_fd;
+	context.drm_fd = drm_fd;
+	context.verbose = !config->quiet;
+
+	rc = context_start(config, preset, format, media_fd, &context);
+	if (rc < 0)
+		goto error;
+
+	if (config->sink == SINK_TYPE_DISPLAY) {
+		rc = display_engine_start(drm_fd, context.width,
+					  context.height, format,
+					  context.video_buffers,
+					  context.buffers_count,
+					  &context.gem_buffers, display_setup);
+		if (rc < 0) {
+			fprintf(stderr, "Unable to start display engine\n");
+			goto error;
+		}
+
+		/* Same condition as for mapping decoded frames before use. */
+		setup->destination_cpu_access = !display_setup->use_dmabuf;
+	}
+
+	if (config->sink == SINK_TYPE_FILE) {
+		context.sink_file = fopen(config->sink_path, "wb");
+		if (context.sink_file == NULL) {
+			fprintf(stderr, "Unable to open sink file: %s\n",
+				strerror(errno));
+			goto error;
+		}
+	}
+
+	rc = frame_last_use_create(preset, &context.last_use);
+	if (rc < 0)
+		goto error;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		fprintf(stderr, "Unable to create epoll instance: %s\n",
+			strerror(errno));
+		goto error;
+	}
+
+	rc = event_add(epoll_fd, video_fd, EPOLLPRI,
+		       EVENT_DATA(EVENT_TYPE_VIDEO, 0));
+	if (rc < 0)
+		goto error;
+
+	if (config->sink == SINK_TYPE_DISPLAY) {
+		rc = event_add(epoll_fd, drm_fd, EPOLLIN,
+			       EVENT_DATA(EVENT_TYPE_DISPLAY, 0));
+		if (rc < 0)
+			goto error;
+	}
+
+	if (config->interactive) {
+		rc = event_add(epoll_fd, STDIN_FILENO, EPOLLIN,
+			       EVENT_DATA(EVENT_TYPE_INPUT, 0));
+		if (rc < 0)
+			goto error;
+	} else if (config->fps > 0) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd < 0) {
+			fprintf(stderr, "Unable to create timer: %s\n",
+				strerror(errno));
+			goto error;
+		}
+
+		/* One frame per second and slower does not fit in tv_nsec. */
+		period = 1000000000ULL / config->fps;
+
+		memset(&timer_spec, 0, sizeof(timer_spec));
+		timer_spec.it_interval.tv_sec = period / 1000000000ULL;
+		timer_spec.it_interval.tv_nsec = period % 1000000000ULL;
+		timer_spec.it_value = timer_spec.it_interval;
+
+		rc = timerfd_settime(timer_fd, 0, &timer_spec, NULL);
+		if (rc < 0) {
+			fprintf(stderr, "Unable to set timer: %s\n",
+				strerror(errno));
+			goto error;
+		}
+
+		rc = event_add(epoll_fd, timer_fd, EPOLLIN,
+			       EVENT_DATA(EVENT_TYPE_TIMER, 0));
+		if (rc < 0)
+			goto error;
+	}
+
+	display_paced = config->interactive || config->fps > 0;
+	display_credits = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall_before);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_before);
+
+	while (1) {
+		if (context.display_count == context.gop.display_count &&
+		    context.queued_count == 0 && !display_setup->flip_pending) {
+			if (!config->loop)
+				break;
+
+			for (i = 0; i < context.buffers_count; i++)
+				if (i != context.shown_index)
+					context.video_buffers[i].state =
+						VIDEO_BUFFER_STATE_FREE;
+
+			context.display_count = 0;
+			context.decode_index = 0;
+			context.slice_index = 0;
+		}
+
+		/*
+		 * Reallocate destination buffers for a new resolution once
+		 * decoding has drained and nothing decoded is left to display.
+		 * A frame that was partly queued holds its destination buffer
+		 * until its last slice.
+		 */
+		if (resize_pending && context.queued_count == 0 &&
+		    context.slice_index == 0 && !display_setup->flip_pending) {
+			rc = frame_gop_next(&context.gop, &display_index);
+
+			if (context.display_count == context.gop.display_count ||
+			    rc < 0 || display_index >= context.decode_index ||
+			    context.video_buffers[context.frame_slots[display_index]].state !=
+				    VIDEO_BUFFER_STATE_DECODED) {
+				rc = video_engine_resize(video_fd,
+							 &context.video_buffers,
+							 &context.buffers_count,
+							 &context.width,
+							 &context.height,
+							 setup);
+				if (rc < 0) {
+					fprintf(stderr,
+						"Unable to resize video buffers\n");
+					goto error;
+				}
+
+				if (config->sink == SINK_TYPE_DISPLAY)
+					rc = display_engine_resize(drm_fd,
+								   context.width,
+								   context.height,
+								   format,
+								   context.video_buffers,
+								   context.buffers_count,
+								   &context.gem_buffers,
+								   display_setup);
+				if (rc < 0) {
+					fprintf(stderr,
+						"Unable to resize display buffers\n");
+					goto error;
+				}
+
+				if (!config->quiet)
+					printf("Resized destination buffers to %dx%d\n",
+					       context.width, context.height);
+
+				context.shown_index = BUFFER_INDEX_NONE;
+				context.flip_index = BUFFER_INDEX_NONE;
+				resize_pending = false;
+			}
+		}
+
+		/*
+		 * Keep up to pipeline depth requests in flight, one per slice.
+		 * A pending resize only stops queueing between frames.
+		 */
+		while ((!resize_pending || context.slice_index > 0) &&
+		       context.display_count < context.gop.display_count &&
+		       context.decode_index < preset->frames_count &&
+		       context.queued_count < config->pipeline_depth) {
+			buffers_count = context.buffers_count;
+
+			rc = context_queue(config, preset, NULL, &context, 0,
+					   epoll_fd);
+			if (rc < 0)
+				goto error;
+			else if (rc > 0)
+				break;
+
+			if (config->sink != SINK_TYPE_DISPLAY ||
+			    context.buffers_count == buffers_count)
+				continue;
+
+			rc = display_engine_grow(drm_fd, format,
+						 context.video_buffers,
+						 context.buffers_count,
+						 &context.gem_buffers,
+						 display_setup);
+			if (rc < 0) {
+				fprintf(stderr,
+					"Unable to grow display buffers\n");
+				goto error;
+			}
+		}
+
+		display_count = context.display_count;
+
+		rc = context_display(config, format, &context, -1,
+				     display_paced ? &display_credits : NULL);
+		if (rc < 0)
+			goto error;
+
+		/* Displayed frames may release buffers for the next ones. */
+		if (context.display_count != display_count)
+			continue;
+
+		if (context.queued_count == 0 &&
+		    context.display_count < context.gop.display_count &&
+		    !display_setup->flip_pending &&
+		    (!display_paced || display_credits > 0)) {
+			fprintf(stderr,
+				"Unable to find a free buffer to decode frame %d\n",
+				context.decode_index);
+			goto error;
+		}
+
+		/* Recycle completed requests while the decoder is busy. */
+		rc = video_engine_requests_recycle(setup);
+		if (rc < 0)
+			goto error;
+
+		events_count = epoll_wait(epoll_fd, events, ARRAY_SIZE(events),
+					  -1);
+		if (events_count < 0 && errno == EINTR) {
+			continue;
+		} else if (events_count < 0) {
+			fprintf(stderr, "Unable to wait for events: %s\n",
+				strerror(errno));
+			goto error;
+		}
+
+		for (i = 0; i < (unsigned int)events_count; i++) {
+			switch (EVENT_DATA_TYPE(events[i].data.u64)) {
+			case EVENT_TYPE_REQUEST:
+				rc = context_complete(config, NULL, &context, 0,
+						      epoll_fd);
+				if (rc < 0)
+					goto error;
+				break;
+			case EVENT_TYPE_DISPLAY:
+				rc = display_engine_handle_events(drm_fd,
+								  display_setup);
+				if (rc < 0)
+					goto error;
+
+				if (display_setup->flip_pending)
+					break;
+
+				clock_gettime(CLOCK_MONOTONIC, &display_after);
+
+				context.shown_index = context.flip_index;
+				context.flip_index = BUFFER_INDEX_NONE;
+
+				if (!config->quiet) {
+					printf("Displayed video frame %d successfuly!\n",
+					       (unsigned int)INDEX_REF_TS(context.video_buffers[context.shown_index].ts));
+					print_time_diff(&context.display_before,
+							&display_after,
+							"Frame display");
+				}
+				break;
+			case EVENT_TYPE_TIMER:
+				rc = read(timer_fd, &expirations,
+					  sizeof(expirations));
+				if (rc < 0)
+					break;
+
+				/* Pending credit means the last period was missed. */
+				if (display_credits > 0 || expirations > 1)
+					fprintf(stderr,
+						"Unable to meet %d fps target: %d frames late!\n",
+						config->fps,
+						(unsigned int)(display_credits +
+							       expirations - 1));
+
+				display_credits = 1;
+				break;
+			case EVENT_TYPE_INPUT:
+				rc = read(STDIN_FILENO, input, sizeof(input));
+				if (rc <= 0) {
+					/* Stop waiting for input at end of file. */
+					event_remove(epoll_fd, STDIN_FILENO);
+					display_paced = false;
+					break;
+				}
+
+				/* Each line entered allows one more frame. */
+				for (j = 0; j < (unsigned int)rc; j++)
+					if (input[j] == '\n')
+						display_credits++;
+				break;
+			case EVENT_TYPE_VIDEO:
+				rc = video_engine_dequeue_event(video_fd,
+								&event_type,
+								&event_changes);
+				if (rc < 0)
+					goto error;
+
+				if (!config->quiet)
+					printf("Received video event %d\n",
+					       event_type);
+
+				if (event_type == V4L2_EVENT_SOURCE_CHANGE &&
+				    (event_changes &
+				     V4L2_EVENT_SRC_CH_RESOLUTION))
+					resize_pending = true;
+				break;
+			}
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &wall_after);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_after);
+
+	context.stats.wall_time = time_diff(&wall_before, &wall_after);
+	context.stats.cpu_time = time_diff(&cpu_before, &cpu_after);
+
+	if (context.gem_buffers != NULL) {
+		rc = display_engine_stop(drm_fd, context.gem_buffers,
+					 display_setup);
+		context.gem_buffers = NULL;
+		if (rc < 0) {
+			fprintf(stderr, "Unable to stop display engine\n");
+			goto error;
+		}
+	}
+
+	if (!config->quiet)
+		printf("\nUsed %d source and %d destination buffers, %d destination buffers needed\n"
+		       "Allocated %d media requests, %d in flight at most\n",
+		       setup->sources_count, context.buffers_count,
+		       context.stats.buffers_needed, setup->requests_count,
+		       setup->requests_pending_max);
+
+	context.stats.requests_needed = setup->requests_pending_max;
+
+	if (stats != NULL)
+		*stats = context.stats;
+
+	rc = video_engine_stop(video_fd, context.video_buffers,
+			       context.buffers_count, setup);
+	context.video_buffers = NULL;
+	if (rc < 0) {
+		fprintf(stderr, "Unable to stop video engine\n");
+		goto error;
+	}
+
+	rc = 0;
+	goto complete;
+
+error:
+	rc = setup->memory_rejected ? -EOPNOTSUPP : -1;
+
+complete:
+	if (context.gem_buffers != NULL)
+		display_engine_stop(drm_fd, context.gem_buffers,
+				    display_setup);
+
+	context_stop(&context);
+
+	if (context.sink_file != NULL)
+		fclose(context.sink_file);
+
+	if (context.last_use != NULL)
+		free(context.last_use);
+
+	if (timer_fd >= 0)
+		close(timer_fd);
+
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+
+	return rc;
+}
+
+/*
+ * Pick the device where a new context is expected to wait the least: its
+ * queued requests and running contexts times its average frame latency.
+ * Devices without any decoded frame yet are tried first.
+ */
+static unsigned int device_select(struct decode_device *devices,
+				  unsigned int devices_count)
+{
+	unsigned int selected = 0;
+	long load, selected_load = 0;
+	long latency;
+	unsigned int i;
+
+	for (i = 0; i < devices_count; i++) {
+		latency = devices[i].stats.frames_count > 0 ?
+			  devices[i].stats.decode_time /
+			  devices[i].stats.frames_count : 0;
+		load = (devices[i].queued_count + devices[i].contexts_count +
+			1) * latency;
+
+		if (i == 0 || load < selected_load ||
+		    (load == selected_load && devices[i].contexts_count <
+		     devices[selected].contexts_count)) {
+			selected = i;
+			selected_load = load;
+		}
+	}
+
+	return selected;
+}
+
+/* Keep up to pipeline depth requests of a context in flight. */
+static int context_fill(struct config *config, struct preset *preset,
+			struct decode_device *device,
+			struct decode_context *context, unsigned int index,
+			int epoll_fd)
+{
+	int rc;
+
+	while (context->display_count < context->gop.display_count &&
+	       context->decode_index < preset->frames_count &&
+	       context->queued_count < config->pipeline_depth) {
+		rc = context_queue(config, preset, device, context, index,
+				   epoll_fd);
+		if (rc < 0)
+			return -1;
+		else if (rc > 0)
+			break;
+	}
+
+	return 0;
+}
+
+static void print_context_stats(const char *name, struct decode_stats *stats)
+{
+	if (stats->frames_count == 0) {
+		printf("%s: no frames decoded\n", name);
+		return;
+	}
+
+	printf("%s: %d frames in %ld us, %ld fps, %ld us latency (%ld min, %ld max), %ld us hardware per frame\n",
+	       name, stats->frames_count, stats->wall_time,
+	       stats->wall_time > 0 ?
+	       stats->frames_count * 1000000L / stats->wall_time : 0,
+	       stats->decode_time / stats->frames_count,
+	       stats->decode_time_min, stats->decode_time_max,
+	       stats->hardware_time / stats->frames_count);
+}
+
+/*
+ * Decode the preset in several independent contexts at once, all driven by
+ * the same event loop that keeps each context pipeline full. Frames are not
+ * paced and only go to headless sinks.
+ *
+ * With several decoder devices, contexts are admitted one per loop pass and
+ * dispatched to the least loaded device, as measured so far.
+ */
+static int decode_contexts(struct config *config, struct preset *preset,
+			   struct format_description *format,
+			   struct media_decoder *decoders,
+			   unsigned int decoders_count)
+{
+	struct decode_device *devices = NULL;
+	struct decode_device *device;
+	struct decode_context *contexts = NULL;
+	struct decode_context *context;
+	struct decode_stats total;
+	struct epoll_event events[16];
+	struct timespec wall_before, wall_after;
+	struct timespec cpu_before, cpu_after;
+	unsigned int *last_use = NULL;
+	unsigned int contexts_count;
+	unsigned int started_count;
+	unsigned int running_count;
+	unsigned int event_type;
+	unsigned int event_changes;
+	unsigned int index;
+	unsigned int i;
+	char name[160];
+	int events_count;
+	int epoll_fd = -1;
+	int rc;
+
+	contexts_count = config->contexts_count;
+
+	devices = calloc(decoders_count, sizeof(*devices));
+	contexts = calloc(contexts_count, sizeof(*contexts));
+	if (devices == NULL || contexts == NULL) {
+		fprintf(stderr, "Unable to allocate decode contexts\n");
+		goto error;
+	}
+
+	for (i = 0; i < decoders_count; i++)
+		devices[i].media_fd = -1;
+
+	for (i = 0; i < contexts_count; i++) {
+		contexts[i].video_fd = -1;
+		contexts[i].drm_fd = -1;
+	}
+
+	for (i = 0; i < decoders_count; i++) {
+		devices[i].decoder = decoders[i];
+		devices[i].media_fd = open(decoders[i].media_path,
+					   O_RDWR | O_NONBLOCK, 0);
+		if (devices[i].media_fd < 0) {
+			fprintf(stderr, "Unable to open media node: %s\n",
+				strerror(errno));
+			goto error;
+		}
+	}
+
+	rc = frame_last_use_create(preset, &last_use);
+	if (rc < 0)
+		goto error;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		fprintf(stderr, "Unable to create epoll instance: %s\n",
+			strerror(errno));
+		goto error;
+	}
+
+	printf("Decoding with %d contexts on %d devices\n", contexts_count,
+	       decoders_count);
+
+	clock_gettime(CLOCK_MONOTONIC, &wall_before);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_before);
+
+	started_count = 0;
+	running_count = contexts_count;
+
+	while (running_count > 0) {
+		while (started_count < contexts_count) {
+			context = &contexts[started_count];
+			context->device_index = device_select(devices,
+							      decoders_count);
+			device = &devices[context->device_index];
+			context->last_use = last_use;
+
+			context->video_fd = open(device->decoder.video_path,
+						 O_RDWR | O_NONBLOCK, 0);
+			if (context->video_fd < 0) {
+				fprintf(stderr,
+					"Unable to open video node: %s\n",
+					strerror(errno));
+				goto error;
+			}
+
+			rc = context_start(config, preset, format,
+					   device->media_fd, context);
+			if (rc < 0) {
+				fprintf(stderr,
+					"Unable to start decode context %d\n",
+					started_count);
+				goto error;
+			}
+
+			rc = event_add(epoll_fd, context->video_fd, EPOLLPRI,
+				       EVENT_DATA(EVENT_TYPE_VIDEO,
+						  CONTEXT_INDEX(started_count,
+								0)));
+			if (rc < 0)
+				goto error;
+
+			if (!config->quiet)
+				printf("Dispatched context %d to %s\n",
+				       started_count,
+				       device->decoder.video_path);
+
+			device->contexts_count++;
+			started_count++;
+
+			if (decoders_count > 1)
+				break;
+		}
+
+		for (i = 0; i < started_count; i++) {
+			context = &contexts[i];
+			device = &devices[context->device_index];
+
+			if (context->display_count == context->gop.display_count &&
+			    context->queued_count == 0)
+				continue;
+
+			rc = context_display(config, format, context, i, NULL);
+			if (rc < 0)
+				goto error;
+
+			rc = context_fill(config, preset, device, context, i,
+					  epoll_fd);
+			if (rc < 0)
+				goto error;
+
+			if (context->display_count == context->gop.display_count &&
+			    context->queued_count == 0) {
+				clock_gettime(CLOCK_MONOTONIC, &wall_after);
+				context->stats.wall_time =
+					time_diff(&context->start_time,
+						  &wall_after);
+				device->contexts_count--;
+				running_count--;
+				continue;
+			}
+
+			if (context->queued_count == 0) {
+				fprintf(stderr,
+					"Unable to find a free buffer to decode frame %d in context %d\n",
+					context->decode_index, i);
+				goto error;
+			}
+
+			rc = video_engine_requests_recycle(&context->video_setup);
+			if (rc < 0)
+				goto error;
+		}
+
+		if (running_count == 0)
+			break;
 
-	printf("Preset:\n");
-	printf(" Name: %s\n", preset->name);
-	printf(" Description: %s\n", preset->description);
-	printf(" License: %s\n", preset->license);
-	printf(" Attribution: %s\n", preset->attribution);
-	printf(" Width: %d\n", preset->width);
-	printf(" Height: %d\n", preset->height);
-	printf(" Frames count: %d\n", preset->frames_count);
+		/* Nothing to wait for until the next context is admitted. */
+		if (running_count == contexts_count - started_count)
+			continue;
 
-	printf(" Format: ");
+		events_count = epoll_wait(epoll_fd, events, ARRAY_SIZE(events),
+					  -1);
+		if (events_count < 0 && errno == EINTR) {
+			continue;
+		} else if (events_count < 0) {
+			fprintf(stderr, "Unable to wait for events: %s\n",
+				strerror(errno));
+			goto error;
+		}
 
-	switch (preset->type) {
-	case CODEC_TYPE_MPEG2:
-		printf("MPEG2");
-		break;
-	case CODEC_TYPE_H264:
-		printf("H264");
-		break;
-	case CODEC_TYPE_H265:
-		printf("H265");
-		break;
-	default:
-		printf("Invalid");
-		break;
+		for (i = 0; i < (unsigned int)events_count; i++) {
+			index = EVENT_DATA_INDEX(events[i].data.u64);
+			context = &contexts[CONTEXT_INDEX_CONTEXT(index)];
+			device = &devices[context->device_index];
+
+			switch (EVENT_DATA_TYPE(events[i].data.u64)) {
+			case EVENT_TYPE_REQUEST:
+				rc = context_complete(config, device, context,
+						      CONTEXT_INDEX_CONTEXT(index),
+						      epoll_fd);
+				if (rc < 0)
+					goto error;
+				break;
+			case EVENT_TYPE_VIDEO:
+				rc = video_engine_dequeue_event(context->video_fd,
+								&event_type,
+								&event_changes);
+				if (rc < 0)
+					goto error;
+
+				if (event_type == V4L2_EVENT_SOURCE_CHANGE &&
+				    (event_changes &
+				     V4L2_EVENT_SRC_CH_RESOLUTION)) {
+					fprintf(stderr,
+						"Unable to resize buffers of context %d\n",
+						CONTEXT_INDEX_CONTEXT(index));
+					goto error;
+				}
+				break;
+			}
+		}
 	}
 
-	printf("\n\n");
-}
+	clock_gettime(CLOCK_MONOTONIC, &wall_after);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_after);
 
-static long time_diff(struct timespec *before, struct timespec *after)
-{
-	long before_time = before->tv_sec * 1000000 + before->tv_nsec / 1000;
-	long after_time = after->tv_sec * 1000000 + after->tv_nsec / 1000;
+	memset(&total, 0, sizeof(total));
 
-	return (after_time - before_time);
-}
+	total.wall_time = time_diff(&wall_before, &wall_after);
+	total.cpu_time = time_diff(&cpu_before, &cpu_after);
 
-static void print_time_diff(struct timespec *before, struct timespec *after,
-			    const char *prefix)
-{
-	long diff = time_diff(before, after);
-	printf("%s time: %ld us\n", prefix, diff);
-}
+	printf("\n");
 
-static int load_data(const char *path, void **data, unsigned int *size)
-{
-	void *buffer = NULL;
-	unsigned int length;
-	struct stat st;
-	int fd;
-	int rc;
+	for (i = 0; i < contexts_count; i++) {
+		context = &contexts[i];
 
-	rc = stat(path, &st);
-	if (rc < 0) {
-		fprintf(stderr, "Stating file failed\n");
-		goto error;
-	}
+		snprintf(name, sizeof(name), "Context %d (%s)", i,
+			 devices[context->device_index].decoder.video_path);
+		print_context_stats(name, &context->stats);
 
-	length = st.st_size;
+		if (context->stats.frames_count == 0)
+			continue;
 
-	buffer = malloc(length);
+		if (total.frames_count == 0 ||
+		    context->stats.decode_time_min < total.decode_time_min)
+			total.decode_time_min = context->stats.decode_time_min;
 
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "Unable to open file path: %s\n",
-			strerror(errno));
-		goto error;
+		if (context->stats.decode_time_max > total.decode_time_max)
+			total.decode_time_max = context->stats.decode_time_max;
+
+		total.frames_count += context->stats.frames_count;
+		total.decode_time += context->stats.decode_time;
+		total.hardware_time += context->stats.hardware_time;
 	}
 
-	rc = read(fd, buffer, length);
-	if (rc < 0) {
-		fprintf(stderr, "Unable to read file data: %s\n",
-			strerror(errno));
-		goto error;
+	/* Utilization is the share of the run with requests queued. */
+	for (i = 0; i < decoders_count; i++) {
+		device = &devices[i];
+		device->stats.wall_time = total.wall_time;
+
+		snprintf(name, sizeof(name), "Device %d (%s)", i,
+			 device->decoder.video_path);
+		print_context_stats(name, &device->stats);
+
+		printf("Device %d (%s): %ld%% busy, %d requests queued at most\n",
+		       i, device->decoder.video_path,
+		       total.wall_time > 0 ?
+		       device->busy_time * 100 / total.wall_time : 0,
+		       device->queued_max);
 	}
 
-	close(fd);
+	print_context_stats("All contexts", &total);
 
-	*data = buffer;
-	*size = length;
+	if (total.frames_count > 0)
+		printf("All contexts: %ld us CPU per frame\n",
+		       total.cpu_time / total.frames_count);
 
 	rc = 0;
 	goto complete;
 
 error:
-	if (buffer != NULL)
-		free(buffer);
-
 	rc = -1;
 
 complete:
-	return rc;
-}
+	if (contexts != NULL) {
+		for (i = 0; i < contexts_count; i++) {
+			context_stop(&contexts[i]);
 
-static void setup_config(struct config *config)
-{
-	memset(config, 0, sizeof(*config));
+			if (contexts[i].video_fd >= 0)
+				close(contexts[i].video_fd);
+		}
 
-	config->video_path = strdup("/dev/video0");
-	config->media_path = strdup("/dev/media0");
-	config->drm_path = strdup("/dev/dri/card0");
-	config->drm_driver = strdup("sun4i-drm");
+		free(contexts);
+	}
 
-	config->preset_name = strdup("bbb-mpeg2");
-	config->slices_filename_format = strdup("slice-%d.dump");
+	if (devices != NULL) {
+		for (i = 0; i < decoders_count; i++)
+			if (devices[i].media_fd >= 0)
+				close(devices[i].media_fd);
 
-	config->fps = 0;
-	config->quiet = false;
-	config->interactive = false;
-	config->loop = false;
-}
+		free(devices);
+	}
 
-static void cleanup_config(struct config *config)
-{
-	free(config->video_path);
-	free(config->media_path);
-	free(config->drm_path);
-	free(config->drm_driver);
+	if (last_use != NULL)
+		free(last_use);
 
-	free(config->preset_name);
-	free(config->slices_path);
-	free(config->slices_filename_format);
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+
+	return rc;
 }
 
 int main(int argc, char *argv[])
 {
 	struct preset *preset;
 	struct config config;
-	struct video_buffer *video_buffers;
-	struct video_setup video_setup;
-	struct gem_buffer *gem_buffers;
-	struct display_setup display_setup;
 	struct media_device_info device_info;
-	struct frame frame;
-	struct timespec before, after;
-	struct timespec video_before, video_after;
-	struct timespec display_before, display_after;
 	struct format_description *selected_format = NULL;
-	bool before_taken = false;
-	void *slice_data = NULL;
-	char *slice_filename = NULL;
-	char *slice_path = NULL;
-	unsigned int slice_size;
+	struct decode_stats stats;
+	struct decode_stats hints_stats;
+	struct media_discovery discovery;
+	struct media_decoder decoders[8];
+	unsigned int decoders_count;
 	unsigned int width;
 	unsigned int height;
-	unsigned int v4l2_index;
-	unsigned int index;
-	unsigned int index_origin;
-	unsigned int display_index;
-	unsigned int display_count;
-	unsigned int i;
-	long frame_time;
-	long frame_diff;
+	unsigned int i, j;
 	int video_fd = -1;
 	int media_fd = -1;
 	int drm_fd = -1;
-	uint64_t ts;
+	int decoder_fd;
+	unsigned int format_size;
+	unsigned int selected_size = 0;
+	unsigned int depth;
+	bool slices_format_set = false;
+	char *extension;
+	int length;
+	bool drm;
 	bool test;
 	int opt;
 	int rc;
@@ -257,7 +2088,7 @@ int main(int argc, char *argv[])
 	setup_config(&config);
 
 	while (1) {
-		opt = getopt(argc, argv, "v:m:d:D:s:f:P:ilqh");
+		opt = getopt(argc, argv, "v:m:d:D:As:f:o:P:p:n:LS:B:O:C:MbcHilqh");
 		if (opt == -1)
 			break;
 
@@ -278,17 +2109,79 @@ int main(int argc, char *argv[])
 			free(config.drm_driver);
 			config.drm_driver = strdup(optarg);
 			break;
+		case 'A':
+			config.discover = true;
+			break;
 		case 's':
 			free(config.slices_filename_format);
 			config.slices_filename_format = strdup(optarg);
+			slices_format_set = true;
 			break;
 		case 'f':
 			config.fps = atoi(optarg);
 			break;
+		case 'o':
+			if (strcmp(optarg, "display") == 0) {
+				config.sink = SINK_TYPE_DISPLAY;
+			} else if (strcmp(optarg, "discard") == 0) {
+				config.sink = SINK_TYPE_DISCARD;
+			} else if (strcmp(optarg, "checksum") == 0) {
+				config.sink = SINK_TYPE_CHECKSUM;
+			} else {
+				free(config.sink_path);
+				config.sink_path = strdup(optarg);
+				config.sink = SINK_TYPE_FILE;
+			}
+			break;
 		case 'P':
 			free(config.preset_name);
 			config.preset_name = strdup(optarg);
 			break;
+		case 'p':
+			config.pipeline_depth = atoi(optarg);
+			break;
+		case 'n':
+			config.contexts_count = atoi(optarg);
+			break;
+		case 'L':
+			config.dispatch = true;
+			break;
+		case 'S':
+			config.sources_count = atoi(optarg);
+			break;
+		case 'B':
+			config.buffers_count = atoi(optarg);
+			break;
+		case 'O':
+			rc = memory_find(optarg, &config.source_memory, &drm);
+			if (rc < 0 || drm) {
+				fprintf(stderr, "Invalid source memory: %s\n",
+					optarg);
+				goto error;
+			}
+			break;
+		case 'C':
+			rc = memory_find(optarg, &config.destination_memory,
+					 &config.destination_drm);
+			if (rc < 0) {
+				fprintf(stderr,
+					"Invalid destination memory: %s\n",
+					optarg);
+				goto error;
+			}
+			break;
+		case 'M':
+			config.multi_slice = true;
+			break;
+		case 'b':
+			config.benchmark = true;
+			break;
+		case 'c':
+			config.controls_delta = true;
+			break;
+		case 'H':
+			config.cache_hints = true;
+			break;
 		case 'i':
 			config.interactive = true;
 			break;
@@ -316,7 +2209,86 @@ int main(int argc, char *argv[])
 		goto error;
 	}
 
-	config.buffers_count = preset->buffers_count;
+	if (config.discover) {
+		rc = media_engine_discover(preset->type,
+					   config.sink == SINK_TYPE_DISPLAY,
+					   &discovery);
+		if (rc < 0) {
+			fprintf(stderr, "Unable to discover decoder devices\n");
+			goto error;
+		}
+
+		printf("Discovered decoder devices%s\n",
+		       discovery.cached ? " (cached)" : "");
+
+		free(config.video_path);
+		config.video_path = strdup(discovery.video_path);
+		free(config.media_path);
+		config.media_path = strdup(discovery.media_path);
+
+		if (config.sink == SINK_TYPE_DISPLAY) {
+			free(config.drm_path);
+			config.drm_path = strdup(discovery.drm_path);
+			free(config.drm_driver);
+			config.drm_driver = strdup(discovery.drm_driver);
+		}
+	}
+
+	/*
+	 * Start with one destination buffer per request in flight and one
+	 * for display, the pool grows up to what reference lifetimes need.
+	 */
+	if (config.buffers_count == 0)
+		config.buffers_count = config.pipeline_depth + 1;
+
+	if (config.sources_count == 0)
+		config.sources_count = config.pipeline_depth;
+
+	if (config.multi_slice && !slices_format_set) {
+		free(config.slices_filename_format);
+		config.slices_filename_format = strdup("slice-%d-%d.dump");
+	}
+
+	/* Slice parameters files sit next to slices, with their own extension. */
+	if (config.multi_slice) {
+		extension = strrchr(config.slices_filename_format, '.');
+		length = extension != NULL ?
+			 extension - config.slices_filename_format :
+			 strlen(config.slices_filename_format);
+
+		asprintf(&config.slice_params_filename_format, "%.*s.params",
+			 length, config.slices_filename_format);
+	}
+
+	if (config.pipeline_depth == 0) {
+		fprintf(stderr, "Invalid pipeline depth %d\n",
+			config.pipeline_depth);
+		goto error;
+	}
+
+	if (config.contexts_count == 0) {
+		fprintf(stderr, "Invalid contexts count %d\n",
+			config.contexts_count);
+		goto error;
+	}
+
+	/* Contexts are neither paced nor displayed. */
+	if ((config.contexts_count > 1 || config.dispatch) &&
+	    (config.sink == SINK_TYPE_DISPLAY ||
+	     config.sink == SINK_TYPE_FILE || config.interactive ||
+	     config.fps > 0 || config.loop)) {
+		fprintf(stderr,
+			"Multiple contexts require the discard or checksum sink, without pacing or looping\n");
+		goto error;
+	}
+
+	if (config.sources_count == 0 ||
+	    config.sources_count > VIDEO_MAX_FRAME ||
+	    config.buffers_count > VIDEO_MAX_FRAME) {
+		fprintf(stderr, "Invalid buffers count, maximum is %d\n",
+			VIDEO_MAX_FRAME);
+		goto error;
+	}
 
 	width = preset->width;
 	height = preset->height;
@@ -327,6 +2299,13 @@ int main(int argc, char *argv[])
 
 	print_summary(&config, preset);
 
+	rc = slices_size_probe(&config, preset, &config.slice_size_max,
+			       &config.frame_size_max);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to probe slices size\n");
+		goto error;
+	}
+
 	video_fd = open(config.video_path, O_RDWR | O_NONBLOCK, 0);
 	if (video_fd < 0) {
 		fprintf(stderr, "Unable to open video node: %s\n",
@@ -350,20 +2329,61 @@ int main(int argc, char *argv[])
 
 	printf("Media device driver: %s\n", device_info.driver);
 
-	drm_fd = drmOpen(config.drm_driver, config.drm_path);
-	if (drm_fd < 0) {
-		fprintf(stderr, "Unable to open DRM node: %s\n",
-			strerror(errno));
+	if (config.destination_drm && config.sink != SINK_TYPE_DISPLAY) {
+		fprintf(stderr,
+			"DRM destination memory requires the display sink\n");
 		goto error;
 	}
 
+	/* Other sinks run headless, without any DRM device. */
+	if (config.sink == SINK_TYPE_DISPLAY) {
+		drm_fd = drmOpen(config.drm_driver, config.drm_path);
+		if (drm_fd < 0) {
+			fprintf(stderr, "Unable to open DRM node: %s\n",
+				strerror(errno));
+			goto error;
+		}
+	}
+
+	/*
+	 * Pick the format with the smallest frames among the ones that
+	 * both the decoder and the display plane support.
+	 */
+	depth = preset_bit_depth(preset);
+
 	for (i = 0; i < ARRAY_SIZE(formats); i++) {
+		if (formats[i].depth < depth)
+			continue;
+
 		test = video_engine_format_test(video_fd,
 						formats[i].v4l2_mplane, width,
-						height, formats[i].v4l2_format);
-		if (test) {
+						height, preset->type,
+						formats[i].v4l2_format,
+						&format_size);
+		if (!test) {
+			printf("Skipped format: %s (unsupported by decoder)\n",
+			       formats[i].description);
+			continue;
+		}
+
+		if (drm_fd >= 0) {
+			test = display_engine_format_test(drm_fd,
+							  formats[i].drm_format,
+							  formats[i].drm_modifier);
+			if (!test) {
+				printf("Skipped format: %s (unsupported by display)\n",
+				       formats[i].description);
+				continue;
+			}
+		}
+
+		printf("Candidate format: %s (%d bytes per frame)\n",
+		       formats[i].description, format_size);
+
+		if (format_better(&formats[i], format_size, selected_format,
+				  selected_size)) {
 			selected_format = &formats[i];
-			break;
+			selected_size = format_size;
 		}
 	}
 
@@ -393,189 +2413,159 @@ int main(int argc, char *argv[])
 		goto error;
 	}
 
-	rc = video_engine_start(video_fd, media_fd, width, height,
-				selected_format, preset->type, &video_buffers,
-				config.buffers_count, &video_setup);
-	if (rc < 0) {
-		fprintf(stderr, "Unable to start video engine\n");
-		goto error;
-	}
-
-	rc = display_engine_start(drm_fd, width, height, selected_format,
-				  video_buffers, config.buffers_count,
-				  &gem_buffers, &display_setup);
-	if (rc < 0) {
-		fprintf(stderr, "Unable to start display engine\n");
-		goto error;
-	}
-
-	if (config.fps > 0)
-		frame_time = 1000000 / config.fps;
-
-	display_count = 0;
-	display_index = 0;
-	index_origin = index = 0;
-
-	/*
-	 * Display count might be lower than frames count due to potentially
-	 * missing predicted frames. Adapt at GOP scheduling time.
-	 */
-	preset->display_count = preset->frames_count;
-
-	while (display_count < preset->display_count) {
-		if (!config.quiet)
-			printf("\nProcessing frame %d/%d\n", index + 1,
-			       preset->frames_count);
-
-		if ((index_origin != index && index < preset->frames_count) ||
-		    (index == 0 && index == index_origin)) {
-			rc = frame_gop_schedule(preset, index);
-			if (rc < 0) {
-				fprintf(stderr, "Unable to schedule GOP frames order\n");
-				goto error;
-			}
-		}
-
-		index_origin = index;
-
-		rc = frame_gop_next(&display_index);
-		if (rc < 0) {
-			fprintf(stderr, "Unable to get next GOP frame index for display\n");
-			goto error;
-		}
-
-		if (!before_taken)
-			clock_gettime(CLOCK_MONOTONIC, &before);
-		else
-			before_taken = false;
-
-		/* Catch-up with already rendered frames. */
-		if (display_index < index)
-			goto frame_display;
-
-		asprintf(&slice_filename, config.slices_filename_format, index);
-		asprintf(&slice_path, "%s/%s", config.slices_path,
-			 slice_filename);
-
-		free(slice_filename);
-		slice_filename = NULL;
-
-		rc = load_data(slice_path, &slice_data, &slice_size);
-		if (rc < 0) {
-			fprintf(stderr, "Unable to load slice data\n");
+	if (!config.benchmark && config.dispatch) {
+		rc = media_engine_enumerate(preset->type, decoders,
+					    ARRAY_SIZE(decoders),
+					    &decoders_count);
+		if (rc < 0)
 			goto error;
-		}
-
-		free(slice_path);
-		slice_path = NULL;
-
-		if (!config.quiet)
-			printf("Loaded %d bytes of video slice data\n",
-			       slice_size);
 
-		rc = frame_controls_fill(&frame, preset, config.buffers_count,
-					 index, slice_size);
-		if (rc < 0) {
-			fprintf(stderr, "Unable to fill frame controls\n");
-			goto error;
+		/* Decoders must all produce the selected format. */
+		for (i = 0, j = 0; i < decoders_count; i++) {
+			decoder_fd = open(decoders[i].video_path,
+					  O_RDWR | O_NONBLOCK, 0);
+			if (decoder_fd < 0)
+				continue;
+
+			test = video_engine_format_test(decoder_fd,
+							selected_format->v4l2_mplane,
+							width, height,
+							preset->type,
+							selected_format->v4l2_format,
+							&format_size);
+			close(decoder_fd);
+
+			printf("Decoder device: %s (%s)%s\n",
+			       decoders[i].video_path, decoders[i].media_path,
+			       test ? "" : ", destination format unsupported");
+
+			if (test)
+				decoders[j++] = decoders[i];
 		}
 
-		v4l2_index = index % config.buffers_count;
-		ts = TS_REF_INDEX(index);
-		clock_gettime(CLOCK_MONOTONIC, &video_before);
+		decoders_count = j;
 
-		rc = video_engine_decode(video_fd, v4l2_index, &frame.frame,
-					 preset->type, ts, slice_data,
-					 slice_size, video_buffers,
-					 &video_setup);
-		if (rc < 0) {
-			fprintf(stderr, "Unable to decode video frame\n");
+		if (decoders_count == 0) {
+			fprintf(stderr,
+				"Unable to find any decoder for the destination format\n");
 			goto error;
 		}
+	} else {
+		snprintf(decoders[0].media_path, sizeof(decoders[0].media_path),
+			 "%s", config.media_path);
+		snprintf(decoders[0].video_path, sizeof(decoders[0].video_path),
+			 "%s", config.video_path);
+		decoders_count = 1;
+	}
 
-		clock_gettime(CLOCK_MONOTONIC, &video_after);
-
-		free(slice_data);
-		slice_data = NULL;
-
-		if (!config.quiet) {
-			printf("Decoded video frame successfuly!\n");
-			print_time_diff(&video_before, &video_after,
-					"Frame decode");
-		}
-
-		/* Keep decoding until we can display a frame. */
-		if (display_index > index) {
-			before_taken = true;
-			index++;
-			continue;
-		}
-
-frame_display:
-		rc = frame_gop_dequeue();
-		if (rc < 0) {
-			fprintf(stderr,
-				"Unable to dequeue next GOP frame index for display\n");
+	if (!config.benchmark &&
+	    (config.contexts_count > 1 || config.dispatch)) {
+		rc = decode_contexts(&config, preset, selected_format,
+				     decoders, decoders_count);
+		if (rc < 0)
 			goto error;
-		}
 
-		v4l2_index = display_index % config.buffers_count;
-		clock_gettime(CLOCK_MONOTONIC, &display_before);
+		rc = 0;
+		goto complete;
+	}
 
-		rc = display_engine_show(drm_fd, v4l2_index, video_buffers,
-					 gem_buffers, &display_setup);
-		if (rc < 0) {
-			fprintf(stderr, "Unable to display video frame\n");
+	if (!config.benchmark) {
+		rc = decode_preset(&config, preset, selected_format, video_fd,
+				   media_fd, drm_fd, NULL);
+		if (rc < 0)
 			goto error;
-		}
 
-		clock_gettime(CLOCK_MONOTONIC, &display_after);
+		rc = 0;
+		goto complete;
+	}
 
-		if (!config.quiet) {
-			printf("Displayed video frame successfuly!\n");
-			print_time_diff(&display_before, &display_after,
-					"Frame display");
-		}
+	/* Run the preset once with each combination of memory types. */
+	config.quiet = true;
+	config.interactive = false;
+	config.loop = false;
+	config.fps = 0;
+	config.cache_hints = false;
 
-		clock_gettime(CLOCK_MONOTONIC, &after);
+	printf("\nBenchmark:\n");
 
-		display_count++;
+	for (i = 0; i < ARRAY_SIZE(memories); i++) {
+		if (memories[i].drm)
+			continue;
 
-		if (config.interactive) {
-			getchar();
-		} else if (config.fps > 0) {
-			frame_diff = time_diff(&before, &after);
-			if (frame_diff > frame_time)
-				fprintf(stderr,
-					"Unable to meet %d fps target: %ld us late!\n",
-					config.fps, frame_diff - frame_time);
-			else
-				usleep(frame_time - frame_diff);
-		}
+		for (j = 0; j < ARRAY_SIZE(memories); j++) {
+			if (memories[j].drm && drm_fd < 0)
+				continue;
+
+			config.source_memory = memories[i].memory;
+			config.destination_memory = memories[j].memory;
+			config.destination_drm = memories[j].drm;
+
+			printf(" Source %s, destination %s: ",
+			       memories[i].name, memories[j].name);
+			fflush(stdout);
+
+			rc = decode_preset(&config, preset, selected_format,
+					   video_fd, media_fd, drm_fd, &stats);
+			if (rc == -EOPNOTSUPP) {
+				printf("unsupported\n");
+				continue;
+			} else if (rc < 0) {
+				printf("failed, see errors above\n");
+				continue;
+			} else if (stats.frames_count == 0) {
+				printf("failed, no frames decoded\n");
+				continue;
+			}
 
-		if (display_index >= index)
-			index++;
+			printf("%ld us decode (%ld min, %ld max, %ld hardware, %ld userspace), %ld us CPU per frame, %ld slices per second, %d buffers and %d requests needed\n",
+			       stats.decode_time / stats.frames_count,
+			       stats.decode_time_min, stats.decode_time_max,
+			       stats.hardware_time / stats.frames_count,
+			       stats.userspace_time / stats.frames_count,
+			       stats.cpu_time / stats.frames_count,
+			       stats.wall_time > 0 ?
+			       stats.slices_count * 1000000L / stats.wall_time :
+			       0, stats.buffers_needed, stats.requests_needed);
+
+			/* Cache hints only apply to driver-allocated buffers. */
+			if (memories[i].memory != V4L2_MEMORY_MMAP &&
+			    memories[j].memory != V4L2_MEMORY_MMAP)
+				continue;
+
+			printf("  With cache hints: ");
+			fflush(stdout);
+
+			config.cache_hints = true;
+
+			rc = decode_preset(&config, preset, selected_format,
+					   video_fd, media_fd, drm_fd,
+					   &hints_stats);
+
+			config.cache_hints = false;
+
+			if (rc == -EOPNOTSUPP) {
+				printf("unsupported\n");
+				continue;
+			} else if (rc < 0) {
+				printf("failed, see errors above\n");
+				continue;
+			} else if (hints_stats.frames_count == 0) {
+				printf("failed, no frames decoded\n");
+				continue;
+			}
 
-		if (config.loop && display_count == preset->display_count) {
-			display_count = 0;
-			display_index = 0;
-			index_origin = index = 0;
+			printf("%ld us userspace, %ld us CPU per frame, %ld us userspace and %ld us CPU saved per frame\n",
+			       hints_stats.userspace_time /
+			       hints_stats.frames_count,
+			       hints_stats.cpu_time / hints_stats.frames_count,
+			       stats.userspace_time / stats.frames_count -
+			       hints_stats.userspace_time /
+			       hints_stats.frames_count,
+			       stats.cpu_time / stats.frames_count -
+			       hints_stats.cpu_time / hints_stats.frames_count);
 		}
 	}
 
-	rc = video_engine_stop(video_fd, video_buffers, config.buffers_count,
-			       &video_setup);
-	if (rc < 0) {
-		fprintf(stderr, "Unable to stop video engine\n");
-		goto error;
-	}
-
-	rc = display_engine_stop(drm_fd, gem_buffers, &display_setup);
-	if (rc < 0) {
-		fprintf(stderr, "Unable to stop display engine\n");
-		goto error;
-	}
-
 	rc = 0;
 	goto complete;
 
@@ -583,15 +2573,6 @@ error:
 	rc = 1;
 
 complete:
-	if (slice_data != NULL)
-		free(slice_data);
-
-	if (slice_path != NULL)
-		free(slice_path);
-
-	if (slice_filename != NULL)
-		free(slice_filename);
-
 	if (drm_fd >= 0)
 		drmClose(drm_fd);
 
@@ -19,22 +19,41 @@
 #define _V4L2_REQUEST_TEST_H_
 
 #include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
 
 #include <linux/types.h>
 #include <linux/v4l2-controls.h>
 #include <linux/videodev2.h>
 #include <mpeg2-ctrls.h>
 #include <h264-ctrls.h>
+#include <h264-stateless-ctrls.h>
 #include <hevc-ctrls.h>
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 #define TS_REF_INDEX(index) ((index) * 1000)
 #define INDEX_REF_TS(ts) ((ts) / 1000)
 
+#define VIDEO_CONTROLS_MAX 8
+#define VIDEO_CONTROLS_INFO_MAX 16
+#define FRAME_REFERENCES_MAX 16
+
+#define EVENT_DATA(type, index) (((uint64_t)(type) << 32) | (index))
+#define EVENT_DATA_TYPE(data) ((data) >> 32)
+#define EVENT_DATA_INDEX(data) ((data) & 0xffffffff)
+
 /*
  * Structures
  */
 
+enum sink_type {
+	SINK_TYPE_DISPLAY,
+	SINK_TYPE_DISCARD,
+	SINK_TYPE_CHECKSUM,
+	SINK_TYPE_FILE,
+};
+
 struct config {
 	char *video_path;
 	char *media_path;
@@ -44,12 +63,57 @@ struct config {
 	char *preset_name;
 	char *slices_path;
 	char *slices_filename_format;
+	char *slice_params_filename_format;
+
+	enum sink_type sink;
+	char *sink_path;
 
 	unsigned int buffers_count;
+	unsigned int sources_count;
+	unsigned int pipeline_depth;
+	unsigned int source_memory;
+	unsigned int destination_memory;
+	bool destination_drm;
 	unsigned int fps;
+	bool multi_slice;
+	bool controls_delta;
+	bool cache_hints;
+	bool discover;
+	unsigned int contexts_count;
+	bool dispatch;
+	bool benchmark;
 	bool quiet;
 	bool interactive;
 	bool loop;
+
+	/* Every slice of multi-slice frames has its own parameters file. */
+	bool slice_params;
+
+	/* Largest slice and frame in the preset, including start codes. */
+	unsigned int slice_size_max;
+	unsigned int frame_size_max;
+};
+
+enum event_type {
+	EVENT_TYPE_VIDEO,
+	EVENT_TYPE_REQUEST,
+	EVENT_TYPE_DISPLAY,
+	EVENT_TYPE_TIMER,
+	EVENT_TYPE_INPUT,
+};
+
+struct decode_stats {
+	unsigned int frames_count;
+	unsigned int slices_count;
+	unsigned int buffers_needed;
+	unsigned int requests_needed;
+	long decode_time;
+	long decode_time_min;
+	long decode_time_max;
+	long hardware_time;
+	long userspace_time;
+	long wall_time;
+	long cpu_time;
 };
 
 struct format_description {
@@ -61,6 +125,7 @@ struct format_description {
 	uint64_t drm_modifier;
 	unsigned int planes_count;
 	unsigned int bpp;
+	unsigned int depth;
 };
 
 /* Presets */
@@ -93,6 +158,14 @@ union controls {
 		struct v4l2_ctrl_h264_slice_params slice_params;
 		struct v4l2_ctrl_h264_sps sps;
 	} h264;
+	struct {
+		struct v4l2_stateless_h264_decode_params decode_params;
+		struct v4l2_ctrl_h264_pps pps;
+		struct v4l2_stateless_h264_pred_weights pred_weights;
+		struct v4l2_ctrl_h264_scaling_matrix scaling_matrix;
+		struct v4l2_stateless_h264_slice_params slice_params;
+		struct v4l2_ctrl_h264_sps sps;
+	} h264_stateless;
 #endif
 #ifdef V4L2_PIX_FMT_HEVC_SLICE
 	struct {
@@ -116,37 +189,162 @@ struct preset {
 
 	unsigned int width;
 	unsigned int height;
-	unsigned int buffers_count;
 
 	enum codec_type type;
 	struct frame *frames;
 	unsigned int frames_count;
+};
+
+/* Display order of the frames decoded so far, within a stream. */
+struct frame_gop {
+	unsigned int list[64];
+	unsigned int count;
+	unsigned int start;
 	unsigned int display_count;
 };
 
+/* Media */
+
+struct media_discovery {
+	char media_path[128];
+	char video_path[128];
+	char drm_path[128];
+	char drm_driver[128];
+	bool cached;
+};
+
+struct media_decoder {
+	char media_path[128];
+	char video_path[128];
+};
+
 /* V4L2 */
 
+struct video_source {
+	void *map;
+	void *data;
+	unsigned int size;
+	int fd;
+	unsigned int request_index;
+
+	struct v4l2_ext_control controls[VIDEO_CONTROLS_MAX];
+	unsigned int controls_index[VIDEO_CONTROLS_MAX];
+	unsigned int controls_count;
+
+	bool pending;
+	bool hold;
+	unsigned int destination_index;
+};
+
+/*
+ * Media requests are pooled apart from source buffers: completed requests
+ * are only reinitialized before their next use.
+ */
+struct video_request {
+	int fd;
+	bool pending;
+	bool reinit;
+};
+
+/* Capabilities reported by the driver, cached for a format control. */
+struct video_control {
+	unsigned int index;
+	bool supported;
+	bool used;
+
+	unsigned int elem_size;
+	unsigned int elems;
+	unsigned int nr_of_dims;
+	unsigned int dims[V4L2_CTRL_MAX_DIMS];
+	uint64_t menu_mask;
+};
+
 struct video_setup {
 	unsigned int output_type;
 	unsigned int capture_type;
+	unsigned int source_memory;
+	unsigned int destination_memory;
+	bool hold_capture;
+
+	/*
+	 * Non-coherent MMAP buffers get cache maintenance only when the CPU
+	 * accesses their data.
+	 */
+	bool cache_hints;
+	bool source_non_coherent;
+	bool destination_non_coherent;
+	bool destination_cpu_access;
+
+	/* Set when the driver refused to allocate or queue a memory type. */
+	bool memory_rejected;
+
+	/* Source buffers are sized for the largest request payload. */
+	unsigned int slice_size_max;
+	unsigned int frame_size_max;
+	unsigned int source_size;
+	unsigned int source_size_default;
+
+	int media_fd;
+	int udmabuf_fd;
+	int drm_fd;
+	enum codec_type type;
+	struct format_description *format;
+
+	struct video_source *sources;
+	unsigned int sources_count;
+
+	struct video_request *requests;
+	unsigned int requests_count;
+	unsigned int requests_pending;
+	unsigned int requests_pending_max;
+
+	bool controls_delta;
+	bool controls_committed;
+	union controls controls;
+
+	struct video_control controls_info[VIDEO_CONTROLS_INFO_MAX];
+	unsigned int controls_info_count;
+
+	/* Stable stateless controls, converted from the staging ones. */
+	bool stateless;
+	bool frame_based;
+	bool start_code;
+	union controls converted;
 };
 
-struct video_buffer {
-	void *source_map;
-	void *source_data;
-	unsigned int source_size;
+enum video_buffer_state {
+	VIDEO_BUFFER_STATE_FREE,
+	VIDEO_BUFFER_STATE_PENDING,
+	VIDEO_BUFFER_STATE_DECODED,
+	VIDEO_BUFFER_STATE_DISPLAYED,
+};
 
+struct video_buffer {
 	void *destination_map[VIDEO_MAX_PLANES];
 	unsigned int destination_map_lengths[VIDEO_MAX_PLANES];
+	unsigned int destination_map_offsets[VIDEO_MAX_PLANES];
 	void *destination_data[VIDEO_MAX_PLANES];
 	unsigned int destination_sizes[VIDEO_MAX_PLANES];
 	unsigned int destination_offsets[VIDEO_MAX_PLANES];
 	unsigned int destination_bytesperlines[VIDEO_MAX_PLANES];
+	unsigned int destination_heights[VIDEO_MAX_PLANES];
 	unsigned int destination_planes_count;
 	unsigned int destination_buffers_count;
+	int destination_fds[VIDEO_MAX_PLANES];
 
 	int export_fds[VIDEO_MAX_PLANES];
-	int request_fd;
+
+	enum video_buffer_state state;
+	bool held;
+	uint64_t ts;
+	unsigned int serial;
+
+	/* Last decode run, as returned by the driver and seen by us. */
+	unsigned int sequence;
+	unsigned int flags;
+	struct timespec queue_time;
+	struct timespec wakeup_time;
+	struct timespec dequeue_time;
 };
 
 /* DRM */
@@ -191,13 +389,77 @@ struct display_setup {
 	unsigned int y;
 	unsigned int scaled_width;
 	unsigned int scaled_height;
+	unsigned int crtc_width;
+	unsigned int crtc_height;
+	unsigned int zpos;
 
 	unsigned int buffers_count;
+	unsigned int copy_index;
 	bool use_dmabuf;
+	bool flip_pending;
 
 	struct display_properties_ids properties_ids;
 };
 
+/* Decode */
+
+/*
+ * Independent decoding stream, with its own video file descriptor, buffers,
+ * requests and display order scheduling.
+ */
+struct decode_context {
+	unsigned int device_index;
+	struct timespec start_time;
+
+	int video_fd;
+	struct video_setup video_setup;
+	struct video_buffer *video_buffers;
+	unsigned int buffers_count;
+	struct frame_gop gop;
+
+	struct timespec *video_before;
+	unsigned int *frame_slots;
+	unsigned int serial;
+
+	/* Owned by the caller, shared by contexts decoding the same preset. */
+	unsigned int *last_use;
+	bool verbose;
+
+	unsigned int decode_index;
+	unsigned int slice_index;
+	unsigned int slices_count;
+	unsigned int destination_index;
+	unsigned int queued_count;
+	unsigned int display_count;
+
+	/* Sink, with DRM display state for a single context only. */
+	unsigned int width;
+	unsigned int height;
+	FILE *sink_file;
+	int drm_fd;
+	struct gem_buffer *gem_buffers;
+	struct display_setup display_setup;
+	struct timespec display_before;
+	unsigned int shown_index;
+	unsigned int flip_index;
+
+	struct decode_stats stats;
+};
+
+/* Decoder device that contexts are dispatched to. */
+struct decode_device {
+	struct media_decoder decoder;
+	int media_fd;
+
+	unsigned int contexts_count;
+	unsigned int queued_count;
+	unsigned int queued_max;
+	struct timespec busy_time_before;
+	long busy_time;
+
+	struct decode_stats stats;
+};
+
 /*
  * Functions
  */
@@ -208,31 +470,70 @@ void presets_usage(void);
 struct preset *preset_find(char *name);
 int frame_controls_fill(struct frame *frame, struct preset *preset,
 			unsigned int buffers_count, unsigned int index,
-			unsigned int slice_size);
+			unsigned int slice_size,
+			const union controls *slice_params,
+			unsigned int slice_params_size);
+unsigned int preset_bit_depth(struct preset *preset);
 unsigned int frame_pct(struct preset *preset, unsigned int index);
 unsigned int frame_backward_ref_index(struct preset *preset,
 				      unsigned int index);
-int frame_gop_next(unsigned int *index);
-int frame_gop_dequeue(void);
-int frame_gop_queue(unsigned int index);
-int frame_gop_schedule(struct preset *preset, unsigned int index);
+unsigned int frame_references(struct preset *preset, unsigned int index,
+			      unsigned int *references);
+void frame_gop_init(struct frame_gop *gop, struct preset *preset);
+int frame_gop_next(struct frame_gop *gop, unsigned int *index);
+int frame_gop_dequeue(struct frame_gop *gop);
+int frame_gop_queue(struct frame_gop *gop, unsigned int index);
+int frame_gop_schedule(struct frame_gop *gop, struct preset *preset,
+		       unsigned int index);
+
+/* Media */
+
+int media_engine_discover(enum codec_type type, bool display,
+			  struct media_discovery *discovery);
+int media_engine_enumerate(enum codec_type type,
+			   struct media_decoder *decoders,
+			   unsigned int decoders_max,
+			   unsigned int *decoders_count);
 
 /* V4L2 */
 
 bool video_engine_capabilities_test(int video_fd,
 				    unsigned int capabilities_required);
+bool video_engine_codec_test(int video_fd, enum codec_type type);
 bool video_engine_format_test(int video_fd, bool mplane, unsigned int width,
-			      unsigned int height, unsigned int format);
+			      unsigned int height, enum codec_type type,
+			      unsigned int format, unsigned int *size);
 int video_engine_start(int video_fd, int media_fd, unsigned int width,
 		       unsigned int height, struct format_description *format,
 		       enum codec_type type, struct video_buffer **buffers,
-		       unsigned int buffers_count, struct video_setup *setup);
+		       unsigned int buffers_count, unsigned int sources_count,
+		       struct video_setup *setup);
 int video_engine_stop(int video_fd, struct video_buffer *buffers,
 		      unsigned int buffers_count, struct video_setup *setup);
-int video_engine_decode(int video_fd, unsigned int index, union controls *frame,
-			enum codec_type type, uint64_t ts, void *source_data,
-			unsigned int source_size, struct video_buffer *buffers,
-			struct video_setup *setup);
+int video_engine_sources_grow(int video_fd, unsigned int count,
+			      struct video_setup *setup);
+int video_engine_buffers_grow(int video_fd, struct video_buffer **buffers,
+			      unsigned int *buffers_count, unsigned int count,
+			      struct video_setup *setup);
+int video_engine_resize(int video_fd, struct video_buffer **buffers,
+			unsigned int *buffers_count, unsigned int *width,
+			unsigned int *height, struct video_setup *setup);
+int video_engine_queue(int video_fd, unsigned int source_index,
+		       unsigned int destination_index, union controls *frame,
+		       enum codec_type type, uint64_t ts,
+		       unsigned int source_size, bool hold,
+		       struct video_buffer *buffers, struct video_setup *setup);
+int video_engine_source_access(unsigned int index, struct video_setup *setup);
+int video_engine_requests_recycle(struct video_setup *setup);
+int video_engine_controls_test(int video_fd, union controls *frame,
+			       struct video_setup *setup);
+int video_engine_buffer_map(int video_fd, struct video_buffer *buffer,
+			    struct video_setup *setup);
+int video_engine_complete(int video_fd, struct video_buffer *buffers,
+			  unsigned int buffers_count, struct video_setup *setup,
+			  unsigned int *index, int *request_fd);
+int video_engine_dequeue_event(int video_fd, unsigned int *type,
+			       unsigned int *changes);
 
 /* DRM */
 
@@ -243,9 +544,25 @@ int display_engine_start(int drm_fd, unsigned int width, unsigned int height,
 			 struct display_setup *setup);
 int display_engine_stop(int drm_fd, struct gem_buffer *buffers,
 			struct display_setup *setup);
+int display_engine_grow(int drm_fd, struct format_description *format,
+			struct video_buffer *video_buffers, unsigned int count,
+			struct gem_buffer **buffers,
+			struct display_setup *setup);
+int display_engine_memory_create(int drm_fd, unsigned int size, int *fd,
+				 void **map);
+int display_engine_resize(int drm_fd, unsigned int width, unsigned int height,
+			  struct format_description *format,
+			  struct video_buffer *video_buffers,
+			  unsigned int count, struct gem_buffer **buffers,
+			  struct display_setup *setup);
 int display_engine_show(int drm_fd, unsigned int index,
 			struct video_buffer *video_buffers,
 			struct gem_buffer *buffers,
 			struct display_setup *setup);
+int display_engine_handle_events(int drm_fd, struct display_setup *setup);
+bool display_engine_format_test(int drm_fd, unsigned int format,
+				uint64_t modifier);
+int display_engine_discover(bool platform, char *path, unsigned int path_size,
+			    char *driver, unsigned int driver_size);
 
 #endif
@@ -15,9 +15,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,7 +29,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <linux/dma-buf.h>
 #include <linux/media.h>
+#include <linux/udmabuf.h>
 #include <linux/videodev2.h>
 #include <mpeg2-ctrls.h>
 #include <h264-ctrls.h>
@@ -37,17 +41,8 @@
 
 #define SOURCE_SIZE_MAX						(1024 * 1024)
 
-static bool type_is_output(unsigned int type)
-{
-	switch (type) {
-	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
-	case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
-		return true;
-
-	default:
-		return false;
-	}
-}
+/* Some decoders read ahead past the end of the bitstream. */
+#define SOURCE_SIZE_PADDING					64
 
 static bool type_is_mplane(unsigned int type)
 {
@@ -106,17 +101,50 @@ static bool find_format(int video_fd, unsigned int type,
 	return false;
 }
 
+static bool find_frame_size(int video_fd, unsigned int pixelformat,
+			    unsigned int width, unsigned int height)
+{
+	struct v4l2_frmsizeenum frmsize;
+	int rc;
+
+	memset(&frmsize, 0, sizeof(frmsize));
+	frmsize.pixel_format = pixelformat;
+	frmsize.index = 0;
+
+	rc = ioctl(video_fd, VIDIOC_ENUM_FRAMESIZES, &frmsize);
+	if (rc < 0)
+		return true;
+
+	do {
+		switch (frmsize.type) {
+		case V4L2_FRMSIZE_TYPE_DISCRETE:
+			if (frmsize.discrete.width == width &&
+			    frmsize.discrete.height == height)
+				return true;
+			break;
+		case V4L2_FRMSIZE_TYPE_CONTINUOUS:
+		case V4L2_FRMSIZE_TYPE_STEPWISE:
+			return width >= frmsize.stepwise.min_width &&
+			       width <= frmsize.stepwise.max_width &&
+			       height >= frmsize.stepwise.min_height &&
+			       height <= frmsize.stepwise.max_height;
+		}
+
+		frmsize.index++;
+
+		rc = ioctl(video_fd, VIDIOC_ENUM_FRAMESIZES, &frmsize);
+	} while (rc >= 0);
+
+	return false;
+}
+
 static void setup_format(struct v4l2_format *format, unsigned int type,
 			 unsigned int width, unsigned int height,
-			 unsigned int pixelformat)
+			 unsigned int pixelformat, unsigned int sizeimage)
 {
-	unsigned int sizeimage;
-
 	memset(format, 0, sizeof(*format));
 	format->type = type;
 
-	sizeimage = type_is_output(type) ? SOURCE_SIZE_MAX : 0;
-
 	if (type_is_mplane(type)) {
 		format->fmt.pix_mp.width = width;
 		format->fmt.pix_mp.height = height;
@@ -131,37 +159,52 @@ static void setup_format(struct v4l2_format *format, unsigned int type,
 }
 
 static int try_format(int video_fd, unsigned int type, unsigned int width,
-		      unsigned int height, unsigned int pixelformat)
+		      unsigned int height, unsigned int pixelformat,
+		      unsigned int sizeimage, unsigned int *size)
 {
 	struct v4l2_format format;
+	unsigned int i;
 	int rc;
 
-	setup_format(&format, type, width, height, pixelformat);
+	setup_format(&format, type, width, height, pixelformat, sizeimage);
 
+	/* Rejections are expected while negotiating, callers report them. */
 	rc = ioctl(video_fd, VIDIOC_TRY_FMT, &format);
-	if (rc < 0) {
-		fprintf(stderr, "Unable to try format for type %d: %s\n", type,
-			strerror(errno));
+	if (rc < 0)
 		return -1;
+
+	/* Drivers silently replace pixel formats they do not support. */
+	if (type_is_mplane(type)) {
+		if (format.fmt.pix_mp.pixelformat != pixelformat)
+			return -1;
+
+		if (size != NULL)
+			for (i = 0, *size = 0; i < format.fmt.pix_mp.num_planes;
+			     i++)
+				*size += format.fmt.pix_mp.plane_fmt[i].sizeimage;
+	} else {
+		if (format.fmt.pix.pixelformat != pixelformat)
+			return -1;
+
+		if (size != NULL)
+			*size = format.fmt.pix.sizeimage;
 	}
 
 	return 0;
 }
 
 static int set_format(int video_fd, unsigned int type, unsigned int width,
-		      unsigned int height, unsigned int pixelformat)
+		      unsigned int height, unsigned int pixelformat,
+		      unsigned int sizeimage)
 {
 	struct v4l2_format format;
 	int rc;
 
-	setup_format(&format, type, width, height, pixelformat);
+	setup_format(&format, type, width, height, pixelformat, sizeimage);
 
 	rc = ioctl(video_fd, VIDIOC_S_FMT, &format);
-	if (rc < 0) {
-		fprintf(stderr, "Unable to set format for type %d: %s\n", type,
-			strerror(errno));
+	if (rc < 0)
 		return -1;
-	}
 
 	return 0;
 }
@@ -229,17 +272,21 @@ static int get_format(int video_fd, unsigned int type, unsigned int *width,
 	return 0;
 }
 
-static int create_buffers(int video_fd, unsigned int type,
-			  unsigned int buffers_count, unsigned int *index_base)
+static int create_buffers(int video_fd, unsigned int type, unsigned int memory,
+			  unsigned int buffers_count, unsigned int *index_base,
+			  unsigned int *capabilities, unsigned int *flags)
 {
 	struct v4l2_create_buffers buffers;
 	int rc;
 
 	memset(&buffers, 0, sizeof(buffers));
 	buffers.format.type = type;
-	buffers.memory = V4L2_MEMORY_MMAP;
+	buffers.memory = memory;
 	buffers.count = buffers_count;
 
+	if (flags != NULL)
+		buffers.flags = *flags;
+
 	rc = ioctl(video_fd, VIDIOC_G_FMT, &buffers.format);
 	if (rc < 0) {
 		fprintf(stderr, "Unable to get format for type %d: %s\n", type,
@@ -247,16 +294,25 @@ static int create_buffers(int video_fd, unsigned int type,
 		return -1;
 	}
 
+	/* The error code tells unsupported memory types apart. */
 	rc = ioctl(video_fd, VIDIOC_CREATE_BUFS, &buffers);
 	if (rc < 0) {
+		rc = -errno;
 		fprintf(stderr, "Unable to create buffer for type %d: %s\n",
-			type, strerror(errno));
-		return -1;
+			type, strerror(-rc));
+		return rc;
 	}
 
 	if (index_base != NULL)
 		*index_base = buffers.index;
 
+	if (capabilities != NULL)
+		*capabilities = buffers.capabilities;
+
+	/* Flags the driver can't honor are cleared. */
+	if (flags != NULL)
+		*flags = buffers.flags;
+
 	return 0;
 }
 
@@ -304,15 +360,30 @@ static int query_buffer(int video_fd, unsigned int type, unsigned int index,
 	return 0;
 }
 
+static int subscribe_event(int video_fd, unsigned int type)
+{
+	struct v4l2_event_subscription subscription;
+	int rc;
+
+	memset(&subscription, 0, sizeof(subscription));
+	subscription.type = type;
+
+	rc = ioctl(video_fd, VIDIOC_SUBSCRIBE_EVENT, &subscription);
+	if (rc < 0)
+		return -1;
+
+	return 0;
+}
+
 static int request_buffers(int video_fd, unsigned int type,
-			   unsigned int buffers_count)
+			   unsigned int memory, unsigned int buffers_count)
 {
 	struct v4l2_requestbuffers buffers;
 	int rc;
 
 	memset(&buffers, 0, sizeof(buffers));
 	buffers.type = type;
-	buffers.memory = V4L2_MEMORY_MMAP;
+	buffers.memory = memory;
 	buffers.count = buffers_count;
 
 	rc = ioctl(video_fd, VIDIOC_REQBUFS, &buffers);
@@ -326,8 +397,10 @@ static int request_buffers(int video_fd, unsigned int type,
 }
 
 static int queue_buffer(int video_fd, int request_fd, unsigned int type,
-			uint64_t ts, unsigned int index, unsigned int size,
-			unsigned int buffers_count)
+			unsigned int memory, unsigned int flags, uint64_t ts,
+			unsigned int index, unsigned int size,
+			unsigned int buffers_count, int *fds, void **pointers,
+			unsigned int *lengths)
 {
 	struct v4l2_plane planes[buffers_count];
 	struct v4l2_buffer buffer;
@@ -338,10 +411,11 @@ static int queue_buffer(int video_fd, int request_fd, unsigned int type,
 	memset(&buffer, 0, sizeof(buffer));
 
 	buffer.type = type;
-	buffer.memory = V4L2_MEMORY_MMAP;
+	buffer.memory = memory;
 	buffer.index = index;
 	buffer.length = buffers_count;
 	buffer.m.planes = planes;
+	buffer.flags = flags;
 
 	for (i = 0; i < buffers_count; i++)
 		if (type_is_mplane(type))
@@ -349,8 +423,31 @@ static int queue_buffer(int video_fd, int request_fd, unsigned int type,
 		else
 			buffer.bytesused = size;
 
+	if (memory == V4L2_MEMORY_DMABUF) {
+		for (i = 0; i < buffers_count; i++) {
+			if (type_is_mplane(type)) {
+				buffer.m.planes[i].m.fd = fds[i];
+				buffer.m.planes[i].length = lengths[i];
+			} else {
+				buffer.m.fd = fds[0];
+				buffer.length = lengths[0];
+			}
+		}
+	} else if (memory == V4L2_MEMORY_USERPTR) {
+		for (i = 0; i < buffers_count; i++) {
+			if (type_is_mplane(type)) {
+				buffer.m.planes[i].m.userptr =
+					(unsigned long)pointers[i];
+				buffer.m.planes[i].length = lengths[i];
+			} else {
+				buffer.m.userptr = (unsigned long)pointers[0];
+				buffer.length = lengths[0];
+			}
+		}
+	}
+
 	if (request_fd >= 0) {
-		buffer.flags = V4L2_BUF_FLAG_REQUEST_FD;
+		buffer.flags |= V4L2_BUF_FLAG_REQUEST_FD;
 		buffer.request_fd = request_fd;
 	}
 
@@ -359,17 +456,18 @@ static int queue_buffer(int video_fd, int request_fd, unsigned int type,
 
 	rc = ioctl(video_fd, VIDIOC_QBUF, &buffer);
 	if (rc < 0) {
-		fprintf(stderr, "Unable to queue buffer: %s\n",
-			strerror(errno));
-		return -1;
+		rc = -errno;
+		fprintf(stderr, "Unable to queue buffer: %s\n", strerror(-rc));
+		return rc;
 	}
 
 	return 0;
 }
 
 static int dequeue_buffer(int video_fd, int request_fd, unsigned int type,
-			  unsigned int index, unsigned int buffers_count,
-			  bool *error)
+			  unsigned int memory, unsigned int *index,
+			  uint64_t *ts, unsigned int *sequence,
+			  unsigned int buffers_count, unsigned int *flags)
 {
 	struct v4l2_plane planes[buffers_count];
 	struct v4l2_buffer buffer;
@@ -379,8 +477,7 @@ static int dequeue_buffer(int video_fd, int request_fd, unsigned int type,
 	memset(&buffer, 0, sizeof(buffer));
 
 	buffer.type = type;
-	buffer.memory = V4L2_MEMORY_MMAP;
-	buffer.index = index;
+	buffer.memory = memory;
 	buffer.length = buffers_count;
 	buffer.m.planes = planes;
 
@@ -396,8 +493,18 @@ static int dequeue_buffer(int video_fd, int request_fd, unsigned int type,
 		return -1;
 	}
 
-	if (error != NULL)
-		*error = !!(buffer.flags & V4L2_BUF_FLAG_ERROR);
+	if (index != NULL)
+		*index = buffer.index;
+
+	if (ts != NULL)
+		*ts = buffer.timestamp.tv_sec * 1000000000ULL +
+		      buffer.timestamp.tv_usec * 1000ULL;
+
+	if (sequence != NULL)
+		*sequence = buffer.sequence;
+
+	if (flags != NULL)
+		*flags = buffer.flags;
 
 	return 0;
 }
@@ -430,31 +537,169 @@ static int export_buffer(int video_fd, unsigned int type, unsigned int index,
 	return 0;
 }
 
-static int set_control(int video_fd, int request_fd, unsigned int id,
-		       void *data, unsigned int size)
+static int create_udmabuf(int udmabuf_fd, unsigned int size, int *fd,
+			  void **map)
+{
+	struct udmabuf_create create;
+	void *data = MAP_FAILED;
+	int memfd;
+	int rc;
+
+	memfd = memfd_create("v4l2-request-test", MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		fprintf(stderr, "Unable to create memfd: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	rc = ftruncate(memfd, size);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to resize memfd: %s\n",
+			strerror(errno));
+		goto error;
+	}
+
+	/* The udmabuf driver requires the backing memfd not to shrink. */
+	rc = fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to seal memfd: %s\n", strerror(errno));
+		goto error;
+	}
+
+	if (map != NULL) {
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    memfd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "Unable to map memfd: %s\n",
+				strerror(errno));
+			goto error;
+		}
+	}
+
+	memset(&create, 0, sizeof(create));
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = size;
+
+	rc = ioctl(udmabuf_fd, UDMABUF_CREATE, &create);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to create udmabuf: %s\n",
+			strerror(errno));
+		goto error;
+	}
+
+	*fd = rc;
+
+	if (map != NULL)
+		*map = data;
+
+	rc = 0;
+	goto complete;
+
+error:
+	if (data != MAP_FAILED)
+		munmap(data, size);
+
+	rc = -1;
+
+complete:
+	close(memfd);
+
+	return rc;
+}
+
+static int create_memory(int udmabuf_fd, int drm_fd, unsigned int memory,
+			 unsigned int size, int *fd, void **map)
+{
+	switch (memory) {
+	case V4L2_MEMORY_USERPTR:
+		if (map == NULL)
+			return -1;
+
+		*map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (*map == MAP_FAILED) {
+			fprintf(stderr, "Unable to allocate memory: %s\n",
+				strerror(errno));
+			return -1;
+		}
+
+		*fd = -1;
+		return 0;
+	case V4L2_MEMORY_DMABUF:
+		if (drm_fd >= 0)
+			return display_engine_memory_create(drm_fd, size, fd,
+							    map);
+
+		return create_udmabuf(udmabuf_fd, size, fd, map);
+	default:
+		return -1;
+	}
+}
+
+static unsigned int memory_create_flags(unsigned int memory,
+					struct video_setup *setup)
+{
+	/* Only MMAP buffers are allocated by the driver. */
+	if (setup->cache_hints && memory == V4L2_MEMORY_MMAP)
+		return V4L2_MEMORY_FLAG_NON_COHERENT;
+
+	return 0;
+}
+
+static unsigned int page_align(unsigned int size)
+{
+	unsigned int page_size = sysconf(_SC_PAGESIZE);
+
+	return (size + page_size - 1) / page_size * page_size;
+}
+
+static int sync_dmabuf(int fd, bool start)
+{
+	struct dma_buf_sync sync;
+	int rc;
+
+	memset(&sync, 0, sizeof(sync));
+	sync.flags = DMA_BUF_SYNC_WRITE |
+		     (start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END);
+
+	rc = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to sync dmabuf: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int set_controls(int video_fd, int request_fd, bool try,
+			struct v4l2_ext_control *control,
+			unsigned int controls_count, unsigned int *error_index)
 {
-	struct v4l2_ext_control control;
 	struct v4l2_ext_controls controls;
 	int rc;
 
-	memset(&control, 0, sizeof(control));
 	memset(&controls, 0, sizeof(controls));
 
-	control.id = id;
-	control.ptr = data;
-	control.size = size;
-
-	controls.controls = &control;
-	controls.count = 1;
+	controls.controls = control;
+	controls.count = controls_count;
 
 	if (request_fd >= 0) {
 		controls.which = V4L2_CTRL_WHICH_REQUEST_VAL;
 		controls.request_fd = request_fd;
 	}
 
-	rc = ioctl(video_fd, VIDIOC_S_EXT_CTRLS, &controls);
+	rc = ioctl(video_fd, try ? VIDIOC_TRY_EXT_CTRLS : VIDIOC_S_EXT_CTRLS,
+		   &controls);
 	if (rc < 0) {
-		fprintf(stderr, "Unable to set control: %s\n", strerror(errno));
+		fprintf(stderr, "Unable to %s controls: %s\n",
+			try ? "try" : "set", strerror(errno));
+
+		if (error_index != NULL)
+			*error_index = controls.error_idx;
+
 		return -1;
 	}
 
@@ -477,327 +722,1295 @@ static int set_stream(int video_fd, unsigned int type, bool enable)
 	return 0;
 }
 
-static int set_format_controls(int video_fd, int request_fd,
-			       enum codec_type type, union controls *frame)
-{
-	struct {
-		enum codec_type type;
-		char *description;
-		unsigned int id;
-		void *data;
-		unsigned int size;
-	} glue[] = {
-		{ CODEC_TYPE_MPEG2, "slice parameters",
-		  V4L2_CID_MPEG_VIDEO_MPEG2_SLICE_PARAMS,
-		  &frame->mpeg2.slice_params,
-		  sizeof(frame->mpeg2.slice_params) },
-		{ CODEC_TYPE_MPEG2, "quantization matrices",
-		  V4L2_CID_MPEG_VIDEO_MPEG2_QUANTIZATION,
-		  &frame->mpeg2.quantization,
-		  sizeof(frame->mpeg2.quantization) },
+#define FORMAT_CONTROL(t, d, i, m, s, o)				\
+	{ t, d, i, offsetof(union controls, m),				\
+	  sizeof(((union controls *)NULL)->m), s, o, false }
+
+#define STATELESS_CONTROL(t, d, i, m, s, o)				\
+	{ t, d, i, offsetof(union controls, m),				\
+	  sizeof(((union controls *)NULL)->m), s, o, true }
+
+#define MENU_CONTROL(t, d, i)						\
+	{ t, d, i, 0, 0, true, true, true }
+
+/*
+ * Sticky controls describe the stream rather than a given frame: the value
+ * from the previous request is carried over when they are left out.
+ * Optional controls may be missing, in which case drivers use defaults.
+ * Stateless controls belong to the stable codec API and are only used when
+ * the driver exposes it, instead of the staging ones. Slice header controls
+ * are left out with frame-based decoding. Menu controls come without a
+ * payload and are only probed, never sent with requests.
+ */
+
+static const struct {
+	enum codec_type type;
+	char *description;
+	unsigned int id;
+	unsigned int offset;
+	unsigned int size;
+	bool sticky;
+	bool optional;
+	bool stateless;
+} format_controls[] = {
+	FORMAT_CONTROL(CODEC_TYPE_MPEG2, "slice parameters",
+		       V4L2_CID_MPEG_VIDEO_MPEG2_SLICE_PARAMS,
+		       mpeg2.slice_params, false, false),
+	FORMAT_CONTROL(CODEC_TYPE_MPEG2, "quantization matrices",
+		       V4L2_CID_MPEG_VIDEO_MPEG2_QUANTIZATION,
+		       mpeg2.quantization, true, true),
 #ifdef V4L2_PIX_FMT_H264_SLICE
-		{ CODEC_TYPE_H264, "decode parameters",
-		  V4L2_CID_MPEG_VIDEO_H264_DECODE_PARAMS,
-		  &frame->h264.decode_params, sizeof(frame->h264.decode_params) },
-		{ CODEC_TYPE_H264, "picture parameter set",
-		  V4L2_CID_MPEG_VIDEO_H264_PPS, &frame->h264.pps,
-		  sizeof(frame->h264.pps) },
-		{ CODEC_TYPE_H264, "sequence parameter set",
-		  V4L2_CID_MPEG_VIDEO_H264_SPS, &frame->h264.sps,
-		  sizeof(frame->h264.sps) },
-		{ CODEC_TYPE_H264, "scaling matrix",
-		  V4L2_CID_MPEG_VIDEO_H264_SCALING_MATRIX,
-		  &frame->h264.scaling_matrix,
-		  sizeof(frame->h264.scaling_matrix) },
-		{ CODEC_TYPE_H264, "scaling matrix",
-		  V4L2_CID_MPEG_VIDEO_H264_SLICE_PARAMS,
-		  &frame->h264.slice_params, sizeof(frame->h264.slice_params) },
+	FORMAT_CONTROL(CODEC_TYPE_H264, "decode parameters",
+		       V4L2_CID_MPEG_VIDEO_H264_DECODE_PARAMS,
+		       h264.decode_params, false, false),
+	FORMAT_CONTROL(CODEC_TYPE_H264, "picture parameter set",
+		       V4L2_CID_MPEG_VIDEO_H264_PPS, h264.pps, true, false),
+	FORMAT_CONTROL(CODEC_TYPE_H264, "sequence parameter set",
+		       V4L2_CID_MPEG_VIDEO_H264_SPS, h264.sps, true, false),
+	FORMAT_CONTROL(CODEC_TYPE_H264, "scaling matrix",
+		       V4L2_CID_MPEG_VIDEO_H264_SCALING_MATRIX,
+		       h264.scaling_matrix, true, true),
+	FORMAT_CONTROL(CODEC_TYPE_H264, "slice parameters",
+		       V4L2_CID_MPEG_VIDEO_H264_SLICE_PARAMS,
+		       h264.slice_params, false, false),
+	STATELESS_CONTROL(CODEC_TYPE_H264, "decode parameters",
+			  V4L2_CID_STATELESS_H264_DECODE_PARAMS,
+			  h264_stateless.decode_params, false, false),
+	STATELESS_CONTROL(CODEC_TYPE_H264, "picture parameter set",
+			  V4L2_CID_STATELESS_H264_PPS, h264_stateless.pps,
+			  true, false),
+	STATELESS_CONTROL(CODEC_TYPE_H264, "sequence parameter set",
+			  V4L2_CID_STATELESS_H264_SPS, h264_stateless.sps,
+			  true, false),
+	STATELESS_CONTROL(CODEC_TYPE_H264, "scaling matrix",
+			  V4L2_CID_STATELESS_H264_SCALING_MATRIX,
+			  h264_stateless.scaling_matrix, true, true),
+	STATELESS_CONTROL(CODEC_TYPE_H264, "prediction weights",
+			  V4L2_CID_STATELESS_H264_PRED_WEIGHTS,
+			  h264_stateless.pred_weights, false, true),
+	STATELESS_CONTROL(CODEC_TYPE_H264, "slice parameters",
+			  V4L2_CID_STATELESS_H264_SLICE_PARAMS,
+			  h264_stateless.slice_params, false, false),
+	MENU_CONTROL(CODEC_TYPE_H264, "decode mode",
+		     V4L2_CID_STATELESS_H264_DECODE_MODE),
+	MENU_CONTROL(CODEC_TYPE_H264, "start code",
+		     V4L2_CID_STATELESS_H264_START_CODE),
 #endif
 #ifdef V4L2_PIX_FMT_HEVC_SLICE
-		{ CODEC_TYPE_H265, "sequence parameter set",
-		  V4L2_CID_MPEG_VIDEO_HEVC_SPS, &frame->h265.sps,
-		  sizeof(frame->h265.sps) },
-		{ CODEC_TYPE_H265, "picture parameter set",
-		  V4L2_CID_MPEG_VIDEO_HEVC_PPS, &frame->h265.pps,
-		  sizeof(frame->h265.pps) },
-		{ CODEC_TYPE_H265, "slice parameters",
-		  V4L2_CID_MPEG_VIDEO_HEVC_SLICE_PARAMS,
-		  &frame->h265.slice_params, sizeof(frame->h265.slice_params) },
+	FORMAT_CONTROL(CODEC_TYPE_H265, "sequence parameter set",
+		       V4L2_CID_MPEG_VIDEO_HEVC_SPS, h265.sps, true, false),
+	FORMAT_CONTROL(CODEC_TYPE_H265, "picture parameter set",
+		       V4L2_CID_MPEG_VIDEO_HEVC_PPS, h265.pps, true, false),
+	FORMAT_CONTROL(CODEC_TYPE_H265, "slice parameters",
+		       V4L2_CID_MPEG_VIDEO_HEVC_SLICE_PARAMS,
+		       h265.slice_params, false, false),
 #endif
-	};
-	unsigned int i;
+};
+
+static int query_control(int video_fd, unsigned int id,
+			 struct v4l2_query_ext_ctrl *query, uint64_t *menu_mask)
+{
+	struct v4l2_querymenu menu;
+	int64_t i;
 	int rc;
 
-	for (i = 0; i < ARRAY_SIZE(glue); i++) {
-		if (glue[i].type != type)
-			continue;
+	memset(query, 0, sizeof(*query));
+	query->id = id;
 
-		rc = set_control(video_fd, request_fd, glue[i].id, glue[i].data,
-				 glue[i].size);
-		if (rc < 0) {
-			fprintf(stderr, "Unable to set %s control\n",
-				glue[i].description);
-			return -1;
-		}
+	rc = ioctl(video_fd, VIDIOC_QUERY_EXT_CTRL, query);
+	if (rc < 0)
+		return -1;
+
+	if (menu_mask == NULL)
+		return 0;
+
+	*menu_mask = 0;
+
+	if (query->type != V4L2_CTRL_TYPE_MENU &&
+	    query->type != V4L2_CTRL_TYPE_INTEGER_MENU)
+		return 0;
+
+	for (i = query->minimum; i <= query->maximum && i < 64; i++) {
+		memset(&menu, 0, sizeof(menu));
+		menu.id = id;
+		menu.index = i;
+
+		rc = ioctl(video_fd, VIDIOC_QUERYMENU, &menu);
+		if (rc == 0)
+			*menu_mask |= 1ULL << i;
 	}
 
 	return 0;
 }
 
-static int codec_source_format(enum codec_type type)
+static bool control_slice_header(unsigned int id)
 {
-	switch (type) {
-	case CODEC_TYPE_MPEG2:
-		return V4L2_PIX_FMT_MPEG2_SLICE;
-#ifdef V4L2_PIX_FMT_H264_SLICE
-	case CODEC_TYPE_H264:
-		return V4L2_PIX_FMT_H264_SLICE;
-#endif
-#ifdef V4L2_PIX_FMT_HEVC_SLICE
-	case CODEC_TYPE_H265:
-		return V4L2_PIX_FMT_HEVC_SLICE;
-#endif
-	default:
-		fprintf(stderr, "Invalid format type\n");
-		return -1;
-	}
+	return id == V4L2_CID_STATELESS_H264_SLICE_PARAMS ||
+	       id == V4L2_CID_STATELESS_H264_PRED_WEIGHTS;
 }
 
-bool video_engine_capabilities_test(int video_fd,
-				    unsigned int capabilities_required)
+static struct video_control *control_info(struct video_setup *setup,
+					  unsigned int id)
 {
-	unsigned int capabilities;
-	int rc;
-
-	rc = query_capabilities(video_fd, &capabilities);
-	if (rc < 0) {
-		fprintf(stderr, "Unable to query video capabilities: %s\n",
-			strerror(errno));
-		return false;
-	}
+	unsigned int i;
 
-	if ((capabilities & capabilities_required) != capabilities_required)
-		return false;
+	for (i = 0; i < setup->controls_info_count; i++)
+		if (format_controls[setup->controls_info[i].index].id == id)
+			return &setup->controls_info[i];
 
-	return true;
+	return NULL;
 }
 
-bool video_engine_format_test(int video_fd, bool mplane, unsigned int width,
-			      unsigned int height, unsigned int format)
+static bool control_supported(struct video_setup *setup, unsigned int id)
 {
-	unsigned int type;
-	int rc;
-
-	type = mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE :
-			V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	struct video_control *info = control_info(setup, id);
 
-	rc = try_format(video_fd, type, width, height, format);
-
-	return rc >= 0;
+	return info != NULL && info->supported;
 }
 
-int video_engine_start(int video_fd, int media_fd, unsigned int width,
-		       unsigned int height, struct format_description *format,
-		       enum codec_type type, struct video_buffer **buffers,
-		       unsigned int buffers_count, struct video_setup *setup)
+/* The stable API needs every mandatory control besides slice headers. */
+static bool probe_stateless(struct video_setup *setup)
 {
-	struct video_buffer *buffer;
-	unsigned int source_format;
-	unsigned int source_length;
-	unsigned int source_map_offset;
-	unsigned int destination_format;
-	void *destination_map[VIDEO_MAX_PLANES];
-	unsigned int destination_map_lengths[VIDEO_MAX_PLANES];
-	unsigned int destination_map_offsets[VIDEO_MAX_PLANES];
-	unsigned int destination_sizes[VIDEO_MAX_PLANES];
-	unsigned int destination_bytesperlines[VIDEO_MAX_PLANES];
-	unsigned int destination_planes_count;
-	unsigned int export_fds_count;
-	unsigned int output_type, capture_type;
-	unsigned int format_width, format_height;
-	unsigned int i, j;
-	int request_fd;
-	int rc;
+	struct video_control *info;
+	bool found = false;
+	unsigned int index;
+	unsigned int i;
 
-	*buffers = malloc(buffers_count * sizeof(**buffers));
-	memset(*buffers, 0, buffers_count * sizeof(**buffers));
+	for (i = 0; i < setup->controls_info_count; i++) {
+		info = &setup->controls_info[i];
+		index = info->index;
 
-	if (format->v4l2_mplane) {
-		output_type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-		capture_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	} else {
-		output_type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-		capture_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if (!format_controls[index].stateless ||
+		    format_controls[index].optional ||
+		    control_slice_header(format_controls[index].id))
+			continue;
+
+		if (!info->supported)
+			return false;
+
+		found = true;
 	}
 
-	setup->output_type = output_type;
-	setup->capture_type = capture_type;
+	return found;
+}
 
-	source_format = codec_source_format(type);
+#ifdef V4L2_PIX_FMT_H264_SLICE
+static int setup_h264_stateless(int video_fd, struct video_setup *setup)
+{
+	struct v4l2_ext_control controls[2];
+	struct video_control *info;
+	uint64_t decode_modes;
+	uint64_t start_codes;
+	int32_t decode_mode, start_code;
+	int rc;
 
-	rc = set_format(video_fd, output_type, width, height, source_format);
-	if (rc < 0) {
-		fprintf(stderr, "Unable to set source format\n");
-		goto error;
+	/* Both menus are mandatory, but their absence means slice-based. */
+	info = control_info(setup, V4L2_CID_STATELESS_H264_DECODE_MODE);
+	if (info != NULL && info->supported)
+		decode_modes = info->menu_mask;
+	else
+		decode_modes = 1ULL << V4L2_STATELESS_H264_DECODE_MODE_SLICE_BASED;
+
+	info = control_info(setup, V4L2_CID_STATELESS_H264_START_CODE);
+	if (info != NULL && info->supported)
+		start_codes = info->menu_mask;
+	else
+		start_codes = 1ULL << V4L2_STATELESS_H264_START_CODE_NONE;
+
+	/* Whole frames are split by the hardware, which needs start codes. */
+	if ((decode_modes &
+	     (1ULL << V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED)) &&
+	    (start_codes & (1ULL << V4L2_STATELESS_H264_START_CODE_ANNEX_B)))
+		setup->frame_based = true;
+	else if (!(decode_modes &
+		   (1ULL << V4L2_STATELESS_H264_DECODE_MODE_SLICE_BASED))) {
+		fprintf(stderr, "Unable to find a supported decode mode\n");
+		return -1;
 	}
 
-	destination_format = format->v4l2_format;
+	if (setup->frame_based ||
+	    !(start_codes & (1ULL << V4L2_STATELESS_H264_START_CODE_NONE)))
+		setup->start_code = true;
 
-	rc = set_format(video_fd, capture_type, width, height,
-			destination_format);
-	if (rc < 0) {
-		fprintf(stderr, "Unable to set destination format\n");
-		goto error;
-	}
+	decode_mode = setup->frame_based ?
+		      V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED :
+		      V4L2_STATELESS_H264_DECODE_MODE_SLICE_BASED;
+	start_code = setup->start_code ?
+		     V4L2_STATELESS_H264_START_CODE_ANNEX_B :
+		     V4L2_STATELESS_H264_START_CODE_NONE;
 
-	destination_planes_count = format->planes_count;
+	memset(controls, 0, sizeof(controls));
+	controls[0].id = V4L2_CID_STATELESS_H264_DECODE_MODE;
+	controls[0].value = decode_mode;
+	controls[1].id = V4L2_CID_STATELESS_H264_START_CODE;
+	controls[1].value = start_code;
 
-	rc = get_format(video_fd, capture_type, &format_width, &format_height,
-			destination_bytesperlines, destination_sizes, NULL);
+	rc = set_controls(video_fd, -1, false, controls, 2, NULL);
+	if (rc < 0)
+		return -1;
+
+	return 0;
+}
+#endif
+
+/*
+ * Every control of the codec is queried once and cached, with the layout and
+ * menu entries reported by the driver. The controls sent with requests are
+ * then picked from the cache and their payloads checked against it.
+ */
+static int probe_format_controls(int video_fd, struct video_setup *setup)
+{
+	struct v4l2_query_ext_ctrl query;
+	struct video_control *info;
+	unsigned int index;
+	unsigned int i;
+	int rc;
+
+	setup->controls_info_count = 0;
+
+	for (i = 0; i < ARRAY_SIZE(format_controls); i++) {
+		if (format_controls[i].type != setup->type)
+			continue;
+
+		if (setup->controls_info_count >= VIDEO_CONTROLS_INFO_MAX) {
+			fprintf(stderr, "Too many format controls\n");
+			return -1;
+		}
+
+		info = &setup->controls_info[setup->controls_info_count];
+		memset(info, 0, sizeof(*info));
+		info->index = i;
+
+		setup->controls_info_count++;
+
+		rc = query_control(video_fd, format_controls[i].id, &query,
+				   &info->menu_mask);
+		if (rc < 0 && errno == EINVAL) {
+			continue;
+		} else if (rc < 0) {
+			fprintf(stderr, "Unable to query %s control: %s\n",
+				format_controls[i].description,
+				strerror(errno));
+			return -1;
+		}
+
+		info->elem_size = query.elem_size;
+		info->elems = query.elems;
+		info->nr_of_dims = query.nr_of_dims;
+		memcpy(info->dims, query.dims, sizeof(info->dims));
+		info->supported = true;
+	}
+
+	setup->stateless = probe_stateless(setup);
+	setup->frame_based = false;
+	setup->start_code = false;
+
+#ifdef V4L2_PIX_FMT_H264_SLICE
+	if (setup->stateless && setup->type == CODEC_TYPE_H264) {
+		rc = setup_h264_stateless(video_fd, setup);
+		if (rc < 0)
+			return -1;
+	}
+#endif
+
+	for (i = 0; i < setup->controls_info_count; i++) {
+		info = &setup->controls_info[i];
+		index = info->index;
+
+		if (format_controls[index].stateless != setup->stateless ||
+		    format_controls[index].size == 0)
+			continue;
+
+		/* Frame-based decoding parses slice headers in hardware. */
+		if (setup->frame_based &&
+		    control_slice_header(format_controls[index].id))
+			continue;
+
+		/* Left out of requests, the driver uses defaults. */
+		if (!info->supported && format_controls[index].optional) {
+			continue;
+		} else if (!info->supported) {
+			fprintf(stderr, "Missing %s control\n",
+				format_controls[index].description);
+			return -1;
+		}
+
+		if (info->elem_size * info->elems !=
+		    format_controls[index].size) {
+			fprintf(stderr,
+				"Unexpected %s control size %d, expected %d\n",
+				format_controls[index].description,
+				info->elem_size * info->elems,
+				format_controls[index].size);
+			return -1;
+		}
+
+		info->used = true;
+	}
+
+	return 0;
+}
+
+#ifdef V4L2_PIX_FMT_H264_SLICE
+static void convert_h264_reference(struct v4l2_stateless_h264_reference *to,
+				   const __u8 *from, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		to[i].fields = V4L2_STATELESS_H264_FRAME_REF;
+		to[i].index = from[i];
+	}
+}
+
+static void convert_h264_controls(union controls *frame,
+				  union controls *converted)
+{
+	struct v4l2_ctrl_h264_decode_params *decode_params =
+		&frame->h264.decode_params;
+	struct v4l2_ctrl_h264_slice_params *slice_params =
+		&frame->h264.slice_params;
+	struct v4l2_stateless_h264_decode_params *to_decode_params =
+		&converted->h264_stateless.decode_params;
+	struct v4l2_stateless_h264_slice_params *to_slice_params =
+		&converted->h264_stateless.slice_params;
+	struct v4l2_stateless_h264_dpb_entry *dpb;
+	unsigned int i;
+
+	memset(converted, 0, sizeof(*converted));
+
+	/* Parameter sets and scaling matrix kept their layout. */
+	converted->h264_stateless.sps = frame->h264.sps;
+	converted->h264_stateless.pps = frame->h264.pps;
+	converted->h264_stateless.scaling_matrix = frame->h264.scaling_matrix;
+
+	memcpy(&converted->h264_stateless.pred_weights,
+	       &slice_params->pred_weight_table,
+	       sizeof(converted->h264_stateless.pred_weights));
+
+	to_slice_params->header_bit_size = slice_params->header_bit_size;
+	to_slice_params->first_mb_in_slice = slice_params->first_mb_in_slice;
+	to_slice_params->slice_type = slice_params->slice_type;
+	to_slice_params->colour_plane_id = slice_params->colour_plane_id;
+	to_slice_params->redundant_pic_cnt = slice_params->redundant_pic_cnt;
+	to_slice_params->cabac_init_idc = slice_params->cabac_init_idc;
+	to_slice_params->slice_qp_delta = slice_params->slice_qp_delta;
+	to_slice_params->slice_qs_delta = slice_params->slice_qs_delta;
+	to_slice_params->disable_deblocking_filter_idc =
+		slice_params->disable_deblocking_filter_idc;
+	to_slice_params->slice_alpha_c0_offset_div2 =
+		slice_params->slice_alpha_c0_offset_div2;
+	to_slice_params->slice_beta_offset_div2 =
+		slice_params->slice_beta_offset_div2;
+	to_slice_params->num_ref_idx_l0_active_minus1 =
+		slice_params->num_ref_idx_l0_active_minus1;
+	to_slice_params->num_ref_idx_l1_active_minus1 =
+		slice_params->num_ref_idx_l1_active_minus1;
+
+	convert_h264_reference(to_slice_params->ref_pic_list0,
+			       slice_params->ref_pic_list0,
+			       V4L2_STATELESS_H264_REF_LIST_LEN);
+	convert_h264_reference(to_slice_params->ref_pic_list1,
+			       slice_params->ref_pic_list1,
+			       V4L2_STATELESS_H264_REF_LIST_LEN);
+
+	if (slice_params->flags & V4L2_H264_SLICE_FLAG_DIRECT_SPATIAL_MV_PRED)
+		to_slice_params->flags |=
+			V4L2_STATELESS_H264_SLICE_FLAG_DIRECT_SPATIAL_MV_PRED;
+	if (slice_params->flags & V4L2_H264_SLICE_FLAG_SP_FOR_SWITCH)
+		to_slice_params->flags |=
+			V4L2_STATELESS_H264_SLICE_FLAG_SP_FOR_SWITCH;
+
+	for (i = 0; i < V4L2_STATELESS_H264_NUM_DPB_ENTRIES; i++) {
+		dpb = &to_decode_params->dpb[i];
+
+		dpb->reference_ts = decode_params->dpb[i].reference_ts;
+		dpb->pic_num = decode_params->dpb[i].pic_num;
+		dpb->frame_num = decode_params->dpb[i].frame_num;
+		dpb->top_field_order_cnt =
+			decode_params->dpb[i].top_field_order_cnt;
+		dpb->bottom_field_order_cnt =
+			decode_params->dpb[i].bottom_field_order_cnt;
+		dpb->flags = decode_params->dpb[i].flags;
+
+		if (dpb->flags & V4L2_H264_DPB_ENTRY_FLAG_VALID)
+			dpb->fields = V4L2_STATELESS_H264_FRAME_REF;
+	}
+
+	to_decode_params->nal_ref_idc = decode_params->nal_ref_idc;
+	to_decode_params->top_field_order_cnt =
+		decode_params->top_field_order_cnt;
+	to_decode_params->bottom_field_order_cnt =
+		decode_params->bottom_field_order_cnt;
+
+	/* Picture-level syntax moved over from the slice parameters. */
+	to_decode_params->frame_num = slice_params->frame_num;
+	to_decode_params->idr_pic_id = slice_params->idr_pic_id;
+	to_decode_params->pic_order_cnt_lsb = slice_params->pic_order_cnt_lsb;
+	to_decode_params->delta_pic_order_cnt_bottom =
+		slice_params->delta_pic_order_cnt_bottom;
+	to_decode_params->delta_pic_order_cnt0 =
+		slice_params->delta_pic_order_cnt0;
+	to_decode_params->delta_pic_order_cnt1 =
+		slice_params->delta_pic_order_cnt1;
+	to_decode_params->dec_ref_pic_marking_bit_size =
+		slice_params->dec_ref_pic_marking_bit_size;
+	to_decode_params->pic_order_cnt_bit_size =
+		slice_params->pic_order_cnt_bit_size;
+	to_decode_params->slice_group_change_cycle =
+		slice_params->slice_group_change_cycle;
+
+	if (decode_params->flags & V4L2_H264_DECODE_PARAM_FLAG_IDR_PIC)
+		to_decode_params->flags |=
+			V4L2_STATELESS_H264_DECODE_PARAM_FLAG_IDR_PIC;
+	if (slice_params->flags & V4L2_H264_SLICE_FLAG_FIELD_PIC)
+		to_decode_params->flags |=
+			V4L2_STATELESS_H264_DECODE_PARAM_FLAG_FIELD_PIC;
+	if (slice_params->flags & V4L2_H264_SLICE_FLAG_BOTTOM_FIELD)
+		to_decode_params->flags |=
+			V4L2_STATELESS_H264_DECODE_PARAM_FLAG_BOTTOM_FIELD;
+}
+#endif
+
+static union controls *convert_controls(union controls *frame,
+					struct video_setup *setup)
+{
+#ifdef V4L2_PIX_FMT_H264_SLICE
+	if (setup->stateless && setup->type == CODEC_TYPE_H264) {
+		convert_h264_controls(frame, &setup->converted);
+		return &setup->converted;
+	}
+#endif
+
+	return frame;
+}
+
+static int setup_format_controls(struct video_setup *setup,
+				 struct video_source *buffer)
+{
+	struct v4l2_ext_control *control;
+	unsigned int index;
+	unsigned int i;
+
+	memset(buffer->controls, 0, sizeof(buffer->controls));
+	buffer->controls_count = 0;
+
+	for (i = 0; i < setup->controls_info_count; i++) {
+		if (!setup->controls_info[i].used)
+			continue;
+
+		index = setup->controls_info[i].index;
+
+		control = &buffer->controls[buffer->controls_count];
+		control->id = format_controls[index].id;
+		control->size = format_controls[index].size;
+
+		buffer->controls_index[buffer->controls_count] = index;
+		buffer->controls_count++;
+	}
+
+	return 0;
+}
+
+static int set_format_controls(int video_fd, int request_fd,
+			       union controls *frame,
+			       struct video_source *buffer,
+			       struct video_setup *setup)
+{
+	struct v4l2_ext_control controls[VIDEO_CONTROLS_MAX];
+	unsigned int controls_index[VIDEO_CONTROLS_MAX];
+	struct v4l2_ext_control *control = buffer->controls;
+	unsigned int *index = buffer->controls_index;
+	unsigned int count = buffer->controls_count;
+	unsigned int error_index;
+	unsigned int offset, size;
+	unsigned int i, j;
+	int rc;
+
+	/* Only the data pointers change from one frame to another. */
+	for (i = 0; i < buffer->controls_count; i++)
+		buffer->controls[i].ptr = (unsigned char *)frame +
+			format_controls[buffer->controls_index[i]].offset;
+
+	/* Leave out sticky controls that match the last committed value. */
+	if (setup->controls_delta && setup->controls_committed) {
+		for (i = 0, j = 0; i < buffer->controls_count; i++) {
+			offset = format_controls[buffer->controls_index[i]].offset;
+			size = format_controls[buffer->controls_index[i]].size;
+
+			if (format_controls[buffer->controls_index[i]].sticky &&
+			    memcmp((unsigned char *)frame + offset,
+				   (unsigned char *)&setup->controls + offset,
+				   size) == 0)
+				continue;
+
+			controls[j] = buffer->controls[i];
+			controls_index[j] = buffer->controls_index[i];
+			j++;
+		}
+
+		control = controls;
+		index = controls_index;
+		count = j;
+	}
+
+	rc = set_controls(video_fd, request_fd, false, control, count,
+			  &error_index);
 	if (rc < 0) {
-		fprintf(stderr, "Unable to get destination format\n");
-		goto error;
+		if (error_index < count)
+			fprintf(stderr, "Unable to set %s control\n",
+				format_controls[index[error_index]].description);
+
+		return -1;
+	}
+
+	if (setup->controls_delta) {
+		for (i = 0; i < count; i++) {
+			offset = format_controls[index[i]].offset;
+			size = format_controls[index[i]].size;
+
+			if (format_controls[index[i]].sticky)
+				memcpy((unsigned char *)&setup->controls +
+					       offset,
+				       (unsigned char *)frame + offset, size);
+		}
+
+		setup->controls_committed = true;
+	}
+
+	return 0;
+}
+
+static int codec_source_format(enum codec_type type)
+{
+	switch (type) {
+	case CODEC_TYPE_MPEG2:
+		return V4L2_PIX_FMT_MPEG2_SLICE;
+#ifdef V4L2_PIX_FMT_H264_SLICE
+	case CODEC_TYPE_H264:
+		return V4L2_PIX_FMT_H264_SLICE;
+#endif
+#ifdef V4L2_PIX_FMT_HEVC_SLICE
+	case CODEC_TYPE_H265:
+		return V4L2_PIX_FMT_HEVC_SLICE;
+#endif
+	default:
+		fprintf(stderr, "Invalid format type\n");
+		return -1;
+	}
+}
+
+/*
+ * Logical planes are described relative to the first one: the stride is
+ * multiplied, while the number of lines is aligned then divided.
+ *
+ * Decoders write whole coding blocks, so some pad the height of linear
+ * formats up to their block size without reporting it. The padding
+ * alignment bounds the height recovered from the image size: 64 lines
+ * covers the largest coding block (HEVC CTB), while 0 means the layout
+ * already accounts for padding.
+ */
+
+#define LINES_PAD_ALIGN						64
+
+static const struct {
+	unsigned int pixelformat;
+	unsigned int buffers_count;
+	unsigned int planes_count;
+	unsigned int lines_pad_align;
+	struct {
+		unsigned int stride_mul;
+		unsigned int lines_align;
+		unsigned int lines_div;
+	} planes[3];
+} format_layouts[] = {
+	{ V4L2_PIX_FMT_NV12, 1, 2, LINES_PAD_ALIGN,
+	  { { 1, 1, 1 }, { 1, 1, 2 } } },
+	{ V4L2_PIX_FMT_NV16, 1, 2, LINES_PAD_ALIGN,
+	  { { 1, 1, 1 }, { 1, 1, 1 } } },
+	{ V4L2_PIX_FMT_NV24, 1, 2, LINES_PAD_ALIGN,
+	  { { 1, 1, 1 }, { 2, 1, 1 } } },
+#ifdef V4L2_PIX_FMT_P010
+	{ V4L2_PIX_FMT_P010, 1, 2, LINES_PAD_ALIGN,
+	  { { 1, 1, 1 }, { 1, 1, 2 } } },
+#endif
+	{ V4L2_PIX_FMT_NV12M, 2, 2, 0, { { 1, 1, 1 }, { 1, 1, 2 } } },
+	{ V4L2_PIX_FMT_SUNXI_TILED_NV12, 1, 2, 0,
+	  { { 1, 32, 1 }, { 1, 64, 2 } } },
+};
+
+static unsigned int align(unsigned int value, unsigned int alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static int format_layout(unsigned int pixelformat, unsigned int height,
+			 unsigned int buffers_count,
+			 unsigned int *buffers_bytesperlines,
+			 unsigned int *buffers_sizes, unsigned int *planes_count,
+			 unsigned int *bytesperlines, unsigned int *heights,
+			 unsigned int *offsets, unsigned int *sizes)
+{
+	unsigned int lines;
+	unsigned int weight = 0;
+	unsigned int offset = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(format_layouts); i++)
+		if (format_layouts[i].pixelformat == pixelformat)
+			break;
+
+	if (i == ARRAY_SIZE(format_layouts)) {
+		fprintf(stderr, "Unsupported destination pixel format\n");
+		return -1;
+	}
+
+	if (format_layouts[i].buffers_count != buffers_count) {
+		fprintf(stderr,
+			"Unexpected %d buffers for destination pixel format\n",
+			buffers_count);
+		return -1;
+	}
+
+	*planes_count = format_layouts[i].planes_count;
+
+	/* Each plane comes with its own buffer and format description. */
+	if (buffers_count > 1) {
+		for (j = 0; j < buffers_count; j++) {
+			if (buffers_bytesperlines[j] == 0)
+				return -1;
+
+			bytesperlines[j] = buffers_bytesperlines[j];
+			heights[j] = buffers_sizes[j] / bytesperlines[j];
+			offsets[j] = 0;
+			sizes[j] = buffers_sizes[j];
+		}
+
+		return 0;
+	}
+
+	if (buffers_bytesperlines[0] == 0)
+		return -1;
+
+	lines = align(height, format_layouts[i].planes[0].lines_align);
+
+	for (j = 0; j < format_layouts[i].planes_count; j++)
+		weight += format_layouts[i].planes[j].stride_mul * 2 /
+			  format_layouts[i].planes[j].lines_div;
+
+	/* Recover unreported padding, up to the next padding alignment. */
+	if (format_layouts[i].lines_pad_align > 0) {
+		j = buffers_sizes[0] * 2 / (buffers_bytesperlines[0] * weight);
+
+		if (j > lines &&
+		    j <= align(lines, format_layouts[i].lines_pad_align))
+			lines = j;
+	}
+
+	for (j = 0; j < format_layouts[i].planes_count; j++) {
+		bytesperlines[j] = buffers_bytesperlines[0] *
+				   format_layouts[i].planes[j].stride_mul;
+		heights[j] = align(lines,
+				   format_layouts[i].planes[j].lines_align) /
+			     format_layouts[i].planes[j].lines_div;
+		offsets[j] = offset;
+		sizes[j] = bytesperlines[j] * heights[j];
+
+		offset += sizes[j];
+	}
+
+	if (offset > buffers_sizes[0]) {
+		fprintf(stderr,
+			"Destination layout exceeds buffer size (%d > %d)\n",
+			offset, buffers_sizes[0]);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int reinit_request(struct video_request *request)
+{
+	int rc;
+
+	rc = ioctl(request->fd, MEDIA_REQUEST_IOC_REINIT, NULL);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to reinit media request: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	request->reinit = false;
+
+	return 0;
+}
+
+static int acquire_request(struct video_setup *setup, unsigned int *index)
+{
+	struct video_request *requests;
+	unsigned int recycle = setup->requests_count;
+	unsigned int i;
+	int request_fd;
+	int rc;
+
+	for (i = 0; i < setup->requests_count; i++) {
+		if (setup->requests[i].pending)
+			continue;
+
+		if (!setup->requests[i].reinit) {
+			*index = i;
+			return 0;
+		}
+
+		if (recycle == setup->requests_count)
+			recycle = i;
+	}
+
+	/* Requests that were not recycled in time are reinitialized here. */
+	if (recycle < setup->requests_count) {
+		rc = reinit_request(&setup->requests[recycle]);
+		if (rc < 0)
+			return -1;
+
+		*index = recycle;
+		return 0;
+	}
+
+	rc = ioctl(setup->media_fd, MEDIA_IOC_REQUEST_ALLOC, &request_fd);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to allocate media request: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	requests = realloc(setup->requests,
+			   (setup->requests_count + 1) * sizeof(*requests));
+	if (requests == NULL) {
+		fprintf(stderr, "Unable to allocate media requests\n");
+		close(request_fd);
+		return -1;
+	}
+
+	i = setup->requests_count;
+
+	memset(&requests[i], 0, sizeof(*requests));
+	requests[i].fd = request_fd;
+
+	setup->requests = requests;
+	setup->requests_count++;
+
+	*index = i;
+
+	return 0;
+}
+
+static int create_sources(int video_fd, unsigned int count,
+			  struct video_setup *setup)
+{
+	struct video_source *sources;
+	struct video_source *source;
+	unsigned int source_length;
+	unsigned int source_map_offset;
+	unsigned int capabilities;
+	unsigned int memory_flags;
+	unsigned int index_base;
+	unsigned int first;
+	unsigned int i;
+	int rc;
+
+	first = setup->sources_count;
+
+	sources = realloc(setup->sources, (first + count) * sizeof(*sources));
+	if (sources == NULL) {
+		fprintf(stderr, "Unable to allocate source buffers\n");
+		return -1;
+	}
+
+	memset(&sources[first], 0, count * sizeof(*sources));
+
+	for (i = first; i < first + count; i++)
+		sources[i].fd = -1;
+
+	setup->sources = sources;
+	setup->sources_count = first + count;
+
+	if (setup->source_memory != V4L2_MEMORY_MMAP) {
+		rc = get_format(video_fd, setup->output_type, NULL, NULL, NULL,
+				&source_length, NULL);
+		if (rc < 0) {
+			fprintf(stderr, "Unable to get source format\n");
+			return -1;
+		}
+
+		source_length = page_align(source_length);
 	}
 
-	rc = create_buffers(video_fd, output_type, buffers_count, NULL);
+	memory_flags = memory_create_flags(setup->source_memory, setup);
+
+	rc = create_buffers(video_fd, setup->output_type, setup->source_memory,
+			    count, &index_base, &capabilities, &memory_flags);
+	if (rc == -EINVAL)
+		setup->memory_rejected = true;
+
 	if (rc < 0) {
 		fprintf(stderr, "Unable to create source buffers\n");
-		goto error;
+		return -1;
 	}
 
-	for (i = 0; i < buffers_count; i++) {
-		buffer = &((*buffers)[i]);
+	if (index_base != first) {
+		fprintf(stderr, "Unexpected source buffers index %d\n",
+			index_base);
+		return -1;
+	}
+
+	setup->hold_capture = !!(capabilities &
+				 V4L2_BUF_CAP_SUPPORTS_M2M_HOLD_CAPTURE_BUF);
+	setup->source_non_coherent =
+		!!(memory_flags & V4L2_MEMORY_FLAG_NON_COHERENT);
+
+	for (i = first; i < first + count; i++) {
+		source = &sources[i];
 
-		rc = query_buffer(video_fd, output_type, i, &source_length,
-				  &source_map_offset, 1);
+		if (setup->source_memory != V4L2_MEMORY_MMAP) {
+			rc = create_memory(setup->udmabuf_fd, -1,
+					   setup->source_memory, source_length,
+					   &source->fd, &source->map);
+			if (rc < 0) {
+				fprintf(stderr,
+					"Unable to create source memory\n");
+				return -1;
+			}
+		} else {
+			rc = query_buffer(video_fd, setup->output_type, i,
+					  &source_length, &source_map_offset,
+					  1);
+			if (rc < 0) {
+				fprintf(stderr,
+					"Unable to request source buffer\n");
+				return -1;
+			}
+
+			source->map = mmap(NULL, source_length,
+					   PROT_READ | PROT_WRITE, MAP_SHARED,
+					   video_fd, source_map_offset);
+			if (source->map == MAP_FAILED) {
+				source->map = NULL;
+				fprintf(stderr,
+					"Unable to map source buffer\n");
+				return -1;
+			}
+		}
+
+		source->data = source->map;
+		source->size = source_length;
+
+		rc = setup_format_controls(setup, source);
 		if (rc < 0) {
-			fprintf(stderr, "Unable to request source buffer\n");
-			goto error;
+			fprintf(stderr, "Unable to setup format controls\n");
+			return -1;
 		}
+	}
 
-		buffer->source_map = mmap(NULL, source_length,
-					  PROT_READ | PROT_WRITE, MAP_SHARED,
-					  video_fd, source_map_offset);
-		if (buffer->source_map == MAP_FAILED) {
-			fprintf(stderr, "Unable to map source buffer\n");
-			goto error;
+	return 0;
+}
+
+static int create_destinations(int video_fd, struct video_buffer **buffers,
+			       unsigned int *buffers_count, unsigned int count,
+			       struct video_setup *setup)
+{
+	struct format_description *format = setup->format;
+	struct video_buffer *buffer;
+	unsigned int destination_map_lengths[VIDEO_MAX_PLANES];
+	unsigned int destination_map_offsets[VIDEO_MAX_PLANES];
+	unsigned int destination_sizes[VIDEO_MAX_PLANES];
+	unsigned int destination_bytesperlines[VIDEO_MAX_PLANES];
+	unsigned int destination_heights[VIDEO_MAX_PLANES];
+	unsigned int destination_offsets[VIDEO_MAX_PLANES];
+	unsigned int destination_planes_count;
+	unsigned int buffers_sizes[VIDEO_MAX_PLANES];
+	unsigned int buffers_bytesperlines[VIDEO_MAX_PLANES];
+	unsigned int export_fds_count;
+	unsigned int format_width, format_height;
+	unsigned int index_base;
+	unsigned int memory_flags;
+	unsigned int first;
+	unsigned int i, j, k;
+	int rc;
+
+	first = *buffers_count;
+
+	buffer = realloc(*buffers, (first + count) * sizeof(**buffers));
+	if (buffer == NULL) {
+		fprintf(stderr, "Unable to allocate destination buffers\n");
+		return -1;
+	}
+
+	*buffers = buffer;
+
+	memset(&buffer[first], 0, count * sizeof(**buffers));
+
+	for (i = first; i < first + count; i++) {
+		for (j = 0; j < VIDEO_MAX_PLANES; j++) {
+			buffer[i].destination_fds[j] = -1;
+			buffer[i].export_fds[j] = -1;
 		}
+	}
+
+	*buffers_count = first + count;
+
+	rc = get_format(video_fd, setup->capture_type, &format_width,
+			&format_height, buffers_bytesperlines, buffers_sizes,
+			NULL);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to get destination format\n");
+		return -1;
+	}
 
-		buffer->source_data = buffer->source_map;
-		buffer->source_size = source_length;
+	rc = format_layout(format->v4l2_format, format_height,
+			   format->v4l2_buffers_count, buffers_bytesperlines,
+			   buffers_sizes, &destination_planes_count,
+			   destination_bytesperlines, destination_heights,
+			   destination_offsets, destination_sizes);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to compute destination layout\n");
+		return -1;
 	}
 
-	rc = create_buffers(video_fd, capture_type, buffers_count, NULL);
+	memory_flags = memory_create_flags(setup->destination_memory, setup);
+
+	rc = create_buffers(video_fd, setup->capture_type,
+			    setup->destination_memory, count, &index_base,
+			    NULL, &memory_flags);
+	if (rc == -EINVAL)
+		setup->memory_rejected = true;
+
 	if (rc < 0) {
 		fprintf(stderr, "Unable to create destination buffers\n");
-		goto error;
+		return -1;
 	}
 
-	for (i = 0; i < buffers_count; i++) {
+	setup->destination_non_coherent =
+		!!(memory_flags & V4L2_MEMORY_FLAG_NON_COHERENT);
+
+	if (index_base != first) {
+		fprintf(stderr, "Unexpected destination buffers index %d\n",
+			index_base);
+		return -1;
+	}
+
+	if (setup->destination_memory != V4L2_MEMORY_MMAP)
+		for (j = 0; j < format->v4l2_buffers_count; j++)
+			destination_map_lengths[j] =
+				page_align(buffers_sizes[j]);
+
+	for (i = first; i < first + count; i++) {
 		buffer = &((*buffers)[i]);
 
-		rc = query_buffer(video_fd, capture_type, i,
-				  destination_map_lengths,
-				  destination_map_offsets,
-				  format->v4l2_buffers_count);
-		if (rc < 0) {
-			fprintf(stderr,
-				"Unable to request destination buffer\n");
-			goto error;
+		if (setup->destination_memory == V4L2_MEMORY_MMAP) {
+			rc = query_buffer(video_fd, setup->capture_type, i,
+					  destination_map_lengths,
+					  destination_map_offsets,
+					  format->v4l2_buffers_count);
+			if (rc < 0) {
+				fprintf(stderr,
+					"Unable to request destination buffer\n");
+				return -1;
+			}
 		}
 
+		/*
+		 * Only USERPTR memory has to be mapped here, since the mapping
+		 * is the memory itself. Others are mapped on first CPU access.
+		 */
 		for (j = 0; j < format->v4l2_buffers_count; j++) {
-			destination_map[j] = mmap(NULL,
-						  destination_map_lengths[j],
-						  PROT_READ | PROT_WRITE,
-						  MAP_SHARED,
-						  video_fd,
-						  destination_map_offsets[j]);
-			if (destination_map[j] == MAP_FAILED) {
+			buffer->destination_map_lengths[j] =
+				destination_map_lengths[j];
+
+			if (setup->destination_memory == V4L2_MEMORY_MMAP) {
+				buffer->destination_map_offsets[j] =
+					destination_map_offsets[j];
+				continue;
+			}
+
+			rc = create_memory(setup->udmabuf_fd, setup->drm_fd,
+					   setup->destination_memory,
+					   destination_map_lengths[j],
+					   &buffer->destination_fds[j],
+					   setup->destination_memory ==
+							   V4L2_MEMORY_USERPTR ?
+						   &buffer->destination_map[j] :
+						   NULL);
+			if (rc < 0) {
 				fprintf(stderr,
-					"Unable to map destination buffer\n");
-				goto error;
+					"Unable to create destination memory\n");
+				return -1;
 			}
 		}
 
-		/*
-		 * FIXME: Handle this per-pixelformat, trying to generalize it
-		 * is not a reasonable approach. The final description should be
-		 * in terms of (logical) planes.
-		 */
+		for (j = 0; j < destination_planes_count; j++) {
+			k = format->v4l2_buffers_count > 1 ? j : 0;
+
+			buffer->destination_offsets[j] = destination_offsets[j];
+			buffer->destination_sizes[j] = destination_sizes[j];
+			buffer->destination_bytesperlines[j] =
+				destination_bytesperlines[j];
+			buffer->destination_heights[j] = destination_heights[j];
+
+			if (buffer->destination_map[k] != NULL)
+				buffer->destination_data[j] =
+					(unsigned char *)
+						buffer->destination_map[k] +
+					destination_offsets[j];
+		}
+
+		buffer->destination_planes_count = destination_planes_count;
+		buffer->destination_buffers_count = format->v4l2_buffers_count;
+		export_fds_count = format->v4l2_buffers_count;
+
+		/*
+		 * Only MMAP and DMABUF buffers can be shared with the display,
+		 * which falls back to copying otherwise.
+		 */
+		if (setup->destination_memory == V4L2_MEMORY_MMAP) {
+			rc = export_buffer(video_fd, setup->capture_type, i,
+					   O_RDONLY, buffer->export_fds,
+					   export_fds_count);
+			if (rc < 0) {
+				fprintf(stderr,
+					"Unable to export destination buffer\n");
+				return -1;
+			}
+		} else if (setup->destination_memory == V4L2_MEMORY_DMABUF) {
+			for (j = 0; j < export_fds_count; j++)
+				buffer->export_fds[j] =
+					dup(buffer->destination_fds[j]);
+		}
+
+		buffer->state = VIDEO_BUFFER_STATE_FREE;
+	}
+
+	return 0;
+}
+
+static void destroy_destinations(struct video_buffer *buffers,
+				 unsigned int buffers_count)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < buffers_count; i++) {
+		for (j = 0; j < buffers[i].destination_buffers_count; j++) {
+			if (buffers[i].destination_map[j] == NULL)
+				continue;
+
+			munmap(buffers[i].destination_map[j],
+			       buffers[i].destination_map_lengths[j]);
+		}
+
+		for (j = 0; j < VIDEO_MAX_PLANES; j++) {
+			if (buffers[i].destination_fds[j] >= 0)
+				close(buffers[i].destination_fds[j]);
+
+			if (buffers[i].export_fds[j] >= 0)
+				close(buffers[i].export_fds[j]);
+		}
+	}
+
+	free(buffers);
+}
+
+bool video_engine_capabilities_test(int video_fd,
+				    unsigned int capabilities_required)
+{
+	unsigned int capabilities;
+	int rc;
+
+	rc = query_capabilities(video_fd, &capabilities);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to query video capabilities: %s\n",
+			strerror(errno));
+		return false;
+	}
+
+	if ((capabilities & capabilities_required) != capabilities_required)
+		return false;
+
+	return true;
+}
+
+bool video_engine_codec_test(int video_fd, enum codec_type type)
+{
+	unsigned int source_format;
+	unsigned int capabilities;
+	int rc;
+
+	rc = query_capabilities(video_fd, &capabilities);
+	if (rc < 0)
+		return false;
+
+	source_format = codec_source_format(type);
+
+	if ((capabilities & V4L2_CAP_VIDEO_M2M_MPLANE) &&
+	    find_format(video_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+			source_format))
+		return true;
+
+	if ((capabilities & V4L2_CAP_VIDEO_M2M) &&
+	    find_format(video_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, source_format))
+		return true;
+
+	return false;
+}
+
+bool video_engine_format_test(int video_fd, bool mplane, unsigned int width,
+			      unsigned int height, enum codec_type type,
+			      unsigned int format, unsigned int *size)
+{
+	unsigned int output_type, capture_type;
+	unsigned int source_format;
+	int rc;
+
+	if (mplane) {
+		output_type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		capture_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	} else {
+		output_type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		capture_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	}
+
+	source_format = codec_source_format(type);
+
+	if (!find_frame_size(video_fd, source_format, width, height))
+		return false;
+
+	/* Decoded formats are only enumerated for the current coded format. */
+	rc = set_format(video_fd, output_type, width, height, source_format,
+			SOURCE_SIZE_MAX);
+	if (rc < 0)
+		return false;
+
+	if (!find_format(video_fd, capture_type, format))
+		return false;
+
+	if (!find_frame_size(video_fd, format, width, height))
+		return false;
+
+	rc = try_format(video_fd, capture_type, width, height, format, 0,
+			size);
+
+	return rc >= 0;
+}
+
+int video_engine_start(int video_fd, int media_fd, unsigned int width,
+		       unsigned int height, struct format_description *format,
+		       enum codec_type type, struct video_buffer **buffers,
+		       unsigned int buffers_count, unsigned int sources_count,
+		       struct video_setup *setup)
+{
+	unsigned int source_format;
+	unsigned int source_size;
+	unsigned int destination_format;
+	unsigned int output_type, capture_type;
+	unsigned int count = 0;
+	int rc;
+
+	*buffers = NULL;
+
+	if (format->v4l2_mplane) {
+		output_type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		capture_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	} else {
+		output_type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		capture_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	}
+
+	setup->output_type = output_type;
+	setup->capture_type = capture_type;
+	setup->media_fd = media_fd;
+	setup->udmabuf_fd = -1;
+	setup->type = type;
+	setup->format = format;
+	setup->sources = NULL;
+	setup->sources_count = 0;
+	setup->requests = NULL;
+	setup->requests_count = 0;
+	setup->requests_pending = 0;
+	setup->requests_pending_max = 0;
+	setup->controls_committed = false;
+	setup->memory_rejected = false;
+
+	source_format = codec_source_format(type);
 
+	rc = probe_format_controls(video_fd, setup);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to probe format controls\n");
+		goto error;
+	}
 
-		if (format->v4l2_buffers_count == 1) {
-			destination_sizes[0] = destination_bytesperlines[0] *
-					       format_height;
+	rc = try_format(video_fd, output_type, width, height, source_format,
+			0, &setup->source_size_default);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to try source format\n");
+		goto error;
+	}
 
-			for (j = 1; j < destination_planes_count; j++)
-				destination_sizes[j] = destination_sizes[0] / 2;
+	/* Frame-based decoding needs room for all the slices of a frame. */
+	source_size = setup->frame_based ? setup->frame_size_max :
+					   setup->slice_size_max;
+	if (source_size > 0)
+		source_size = page_align(source_size + SOURCE_SIZE_PADDING);
+	else
+		source_size = SOURCE_SIZE_MAX;
 
-			for (j = 0; j < destination_planes_count; j++) {
-				buffer->destination_map[j] =
-					j == 0 ? destination_map[0] : NULL;
-				buffer->destination_map_lengths[j] =
-					j == 0 ? destination_map_lengths[0] : 0;
-				buffer->destination_offsets[j] =
-					j > 0 ? destination_sizes[j - 1] : 0;
-				buffer->destination_data[j] =
-					(void *)((unsigned char *)
-							 destination_map[0] +
-						 buffer->destination_offsets[j]);
-				buffer->destination_sizes[j] =
-					destination_sizes[j];
-				buffer->destination_bytesperlines[j] =
-					destination_bytesperlines[0];
-			}
-		} else if (format->v4l2_buffers_count ==
-			   destination_planes_count) {
-			for (j = 0; j < destination_planes_count; j++) {
-				buffer->destination_map[j] = destination_map[j];
-				buffer->destination_map_lengths[j] =
-					destination_map_lengths[j];
-				buffer->destination_offsets[j] = 0;
-				buffer->destination_data[j] =
-					destination_map[j];
-				buffer->destination_sizes[j] =
-					destination_sizes[j];
-				buffer->destination_bytesperlines[j] =
-					destination_bytesperlines[j];
-			}
-		} else {
-			fprintf(stderr,
-				"Unsupported combination of %d buffers with %d planes\n",
-				format->v4l2_buffers_count,
-				destination_planes_count);
-			goto error;
-		}
+	rc = set_format(video_fd, output_type, width, height, source_format,
+			source_size);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to set source format\n");
+		goto error;
+	}
 
-		buffer->destination_planes_count = destination_planes_count;
-		buffer->destination_buffers_count = format->v4l2_buffers_count;
-		export_fds_count = format->v4l2_buffers_count;
+	rc = get_format(video_fd, output_type, NULL, NULL, NULL,
+			&setup->source_size, NULL);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to get source format\n");
+		goto error;
+	}
 
-		for (j = 0; j < export_fds_count; j++)
-			buffer->export_fds[j] = -1;
+	destination_format = format->v4l2_format;
 
-		rc = export_buffer(video_fd, capture_type, i, O_RDONLY,
-				   buffer->export_fds, export_fds_count);
-		if (rc < 0) {
-			fprintf(stderr,
-				"Unable to export destination buffer\n");
-			goto error;
-		}
+	rc = set_format(video_fd, capture_type, width, height,
+			destination_format, 0);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to set destination format\n");
+		goto error;
+	}
 
-		rc = ioctl(media_fd, MEDIA_IOC_REQUEST_ALLOC, &request_fd);
-		if (rc < 0) {
-			fprintf(stderr,
-				"Unable to allocate media request: %s\n",
+	/* Destination DMABUF memory may come from the display device. */
+	if (setup->source_memory == V4L2_MEMORY_DMABUF ||
+	    (setup->destination_memory == V4L2_MEMORY_DMABUF &&
+	     setup->drm_fd < 0)) {
+		setup->udmabuf_fd = open("/dev/udmabuf", O_RDWR);
+		if (setup->udmabuf_fd < 0) {
+			fprintf(stderr, "Unable to open udmabuf device: %s\n",
 				strerror(errno));
 			goto error;
 		}
-
-		buffer->request_fd = request_fd;
 	}
 
+	rc = create_sources(video_fd, sources_count, setup);
+	if (rc < 0)
+		goto error;
+
+	rc = create_destinations(video_fd, buffers, &count, buffers_count,
+				 setup);
+	if (rc < 0)
+		goto error;
+
+	/*
+	 * Stateless decoders usually leave resolution changes to userspace,
+	 * so the subscription failing is not an error.
+	 */
+	subscribe_event(video_fd, V4L2_EVENT_SOURCE_CHANGE);
+
 	rc = set_stream(video_fd, output_type, true);
 	if (rc < 0) {
 		fprintf(stderr, "Unable to enable source stream\n");
@@ -810,21 +2023,20 @@ int video_engine_start(int video_fd, int media_fd, unsigned int width,
 		goto error;
 	}
 
-	rc = 0;
-	goto complete;
+	return 0;
 
 error:
-	free(*buffers);
+	video_engine_stop(video_fd, *buffers, count, setup);
 	*buffers = NULL;
 
-complete:
-	return rc;
+	return -1;
 }
 
 int video_engine_stop(int video_fd, struct video_buffer *buffers,
 		      unsigned int buffers_count, struct video_setup *setup)
 {
-	unsigned int i, j;
+	struct video_source *source;
+	unsigned int i;
 	int rc;
 
 	rc = set_stream(video_fd, setup->output_type, false);
@@ -839,70 +2051,234 @@ int video_engine_stop(int video_fd, struct video_buffer *buffers,
 		return -1;
 	}
 
-	for (i = 0; i < buffers_count; i++) {
-		munmap(buffers[i].source_data, buffers[i].source_size);
+	for (i = 0; i < setup->sources_count; i++) {
+		source = &setup->sources[i];
 
-		for (j = 0; j < buffers[i].destination_buffers_count; j++) {
-			if (buffers[i].destination_map[j] == NULL)
-				break;
+		if (source->map != NULL)
+			munmap(source->map, source->size);
 
-			munmap(buffers[i].destination_map[j],
-			       buffers[i].destination_map_lengths[j]);
+		if (source->fd >= 0)
+			close(source->fd);
+	}
 
-			if (buffers[i].export_fds[j] >= 0)
-				close(buffers[i].export_fds[j]);
-		}
+	free(setup->sources);
+	setup->sources = NULL;
+	setup->sources_count = 0;
 
-		for (j = 0; j < buffers[i].destination_buffers_count; j++) {
-			if (buffers[i].export_fds[j] < 0)
-				break;
+	for (i = 0; i < setup->requests_count; i++)
+		close(setup->requests[i].fd);
 
-			close(buffers[i].export_fds[j]);
-		}
+	free(setup->requests);
+	setup->requests = NULL;
+	setup->requests_count = 0;
+	setup->requests_pending = 0;
+
+	destroy_destinations(buffers, buffers_count);
 
-		close(buffers[i].request_fd);
+	if (setup->udmabuf_fd >= 0) {
+		close(setup->udmabuf_fd);
+		setup->udmabuf_fd = -1;
 	}
 
-	free(buffers);
+	/* Release the buffers so that another memory type can be used. */
+	request_buffers(video_fd, setup->output_type, setup->source_memory, 0);
+	request_buffers(video_fd, setup->capture_type,
+			setup->destination_memory, 0);
 
 	return 0;
 }
 
-int video_engine_decode(int video_fd, unsigned int index, union controls *frame,
-			enum codec_type type, uint64_t ts, void *source_data,
-			unsigned int source_size, struct video_buffer *buffers,
-			struct video_setup *setup)
+int video_engine_sources_grow(int video_fd, unsigned int count,
+			      struct video_setup *setup)
 {
-	struct timeval tv = { 0, 300000 };
-	int request_fd = -1;
-	fd_set except_fds;
-	bool source_error, destination_error;
 	int rc;
 
-	request_fd = buffers[index].request_fd;
+	rc = create_sources(video_fd, count, setup);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to grow source buffers\n");
+		return -1;
+	}
+
+	return 0;
+}
 
-	memcpy(buffers[index].source_data, source_data, source_size);
+int video_engine_buffers_grow(int video_fd, struct video_buffer **buffers,
+			      unsigned int *buffers_count, unsigned int count,
+			      struct video_setup *setup)
+{
+	int rc;
 
-	rc = set_format_controls(video_fd, request_fd, type, frame);
+	rc = create_destinations(video_fd, buffers, buffers_count, count,
+				 setup);
 	if (rc < 0) {
-		fprintf(stderr, "Unable to set format controls\n");
+		fprintf(stderr, "Unable to grow destination buffers\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int video_engine_resize(int video_fd, struct video_buffer **buffers,
+			unsigned int *buffers_count, unsigned int *width,
+			unsigned int *height, struct video_setup *setup)
+{
+	unsigned int count = *buffers_count;
+	int rc;
+
+	/* Only the destination queue is reallocated, sources keep going. */
+	rc = set_stream(video_fd, setup->capture_type, false);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to disable destination stream\n");
+		return -1;
+	}
+
+	destroy_destinations(*buffers, *buffers_count);
+	*buffers = NULL;
+	*buffers_count = 0;
+
+	rc = request_buffers(video_fd, setup->capture_type,
+			     setup->destination_memory, 0);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to release destination buffers\n");
 		return -1;
 	}
 
-	rc = queue_buffer(video_fd, request_fd, setup->output_type, ts, index,
-			  source_size, 1);
+	rc = get_format(video_fd, setup->capture_type, width, height, NULL,
+			NULL, NULL);
 	if (rc < 0) {
-		fprintf(stderr, "Unable to queue source buffer\n");
+		fprintf(stderr, "Unable to get destination format\n");
+		return -1;
+	}
+
+	rc = create_destinations(video_fd, buffers, buffers_count, count,
+				 setup);
+	if (rc < 0)
+		return -1;
+
+	rc = set_stream(video_fd, setup->capture_type, true);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to enable destination stream\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int video_engine_queue(int video_fd, unsigned int source_index,
+		       unsigned int destination_index, union controls *frame,
+		       enum codec_type type, uint64_t ts,
+		       unsigned int source_size, bool hold,
+		       struct video_buffer *buffers, struct video_setup *setup)
+{
+	struct video_source *source = &setup->sources[source_index];
+	struct video_buffer *destination = &buffers[destination_index];
+	struct video_request *request;
+	struct timespec queue_time;
+	unsigned int flags = 0;
+	unsigned int destination_flags = 0;
+	unsigned int request_index;
+	int request_fd;
+	int rc;
+
+	if (source->pending) {
+		fprintf(stderr, "Source buffer %d is already pending\n",
+			source_index);
+		return -1;
+	}
+
+	/* Only a held destination buffer can take further slices. */
+	if (destination->state == VIDEO_BUFFER_STATE_PENDING &&
+	    (!destination->held || destination->ts != ts)) {
+		fprintf(stderr, "Buffer %d is already pending\n",
+			destination_index);
+		return -1;
+	}
+
+	if (source_size > source->size) {
+		fprintf(stderr, "Source size %d exceeds buffer size %d\n",
+			source_size, source->size);
+		return -1;
+	}
+
+	if (hold) {
+		if (!setup->hold_capture) {
+			fprintf(stderr,
+				"Holding destination buffers is not supported\n");
+			return -1;
+		}
+
+		flags = V4L2_BUF_FLAG_M2M_HOLD_CAPTURE_BUF;
+	}
+
+	/*
+	 * Bitstream data is written by the CPU but never read back, while
+	 * decoded frames are never written and only read by some sinks.
+	 */
+	if (setup->source_non_coherent)
+		flags |= V4L2_BUF_FLAG_NO_CACHE_INVALIDATE;
+
+	if (setup->destination_non_coherent) {
+		destination_flags = V4L2_BUF_FLAG_NO_CACHE_CLEAN;
+
+		if (!setup->destination_cpu_access)
+			destination_flags |= V4L2_BUF_FLAG_NO_CACHE_INVALIDATE;
+	}
+
+	rc = acquire_request(setup, &request_index);
+	if (rc < 0)
+		return -1;
+
+	/* Whatever happens next, the request has to be reinitialized. */
+	request = &setup->requests[request_index];
+	request->reinit = true;
+	request_fd = request->fd;
+
+	frame = convert_controls(frame, setup);
+
+	rc = set_format_controls(video_fd, request_fd, frame, source, setup);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to set format controls\n");
 		return -1;
 	}
 
-	rc = queue_buffer(video_fd, -1, setup->capture_type, 0, index, 0,
-			  buffers[index].destination_buffers_count);
+	if (setup->source_memory == V4L2_MEMORY_DMABUF) {
+		rc = sync_dmabuf(source->fd, false);
+		if (rc < 0)
+			return -1;
+	}
+
+	rc = queue_buffer(video_fd, request_fd, setup->output_type,
+			  setup->source_memory, flags, ts, source_index,
+			  source_size, 1, &source->fd,
+			  &source->map, &source->size);
+	if (rc == -EINVAL)
+		setup->memory_rejected = true;
+
 	if (rc < 0) {
-		fprintf(stderr, "Unable to queue destination buffer\n");
+		fprintf(stderr, "Unable to queue source buffer\n");
 		return -1;
 	}
 
+	/* The destination buffer is queued along with the first slice. */
+	if (destination->state != VIDEO_BUFFER_STATE_PENDING) {
+		rc = queue_buffer(video_fd, -1, setup->capture_type,
+				  setup->destination_memory, destination_flags, 0,
+				  destination_index, 0,
+				  destination->destination_buffers_count,
+				  destination->destination_fds,
+				  destination->destination_map,
+				  destination->destination_map_lengths);
+		if (rc == -EINVAL)
+			setup->memory_rejected = true;
+
+		if (rc < 0) {
+			fprintf(stderr, "Unable to queue destination buffer\n");
+			return -1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &queue_time);
+
 	rc = ioctl(request_fd, MEDIA_REQUEST_IOC_QUEUE, NULL);
 	if (rc < 0) {
 		fprintf(stderr, "Unable to queue media request: %s\n",
@@ -910,45 +2286,273 @@ int video_engine_decode(int video_fd, unsigned int index, union controls *frame,
 		return -1;
 	}
 
-	FD_ZERO(&except_fds);
-	FD_SET(request_fd, &except_fds);
+	/* Hardware time starts with the first slice of the frame. */
+	if (destination->state != VIDEO_BUFFER_STATE_PENDING)
+		destination->queue_time = queue_time;
+
+	request->pending = true;
+
+	setup->requests_pending++;
+	if (setup->requests_pending > setup->requests_pending_max)
+		setup->requests_pending_max = setup->requests_pending;
+
+	source->pending = true;
+	source->hold = hold;
+	source->destination_index = destination_index;
+	source->request_index = request_index;
+
+	destination->state = VIDEO_BUFFER_STATE_PENDING;
+	destination->held = hold;
+	destination->ts = ts;
+
+	return 0;
+}
+
+int video_engine_source_access(unsigned int index, struct video_setup *setup)
+{
+	/* CPU access to dmabuf source data has to be bracketed with syncs. */
+	if (setup->source_memory == V4L2_MEMORY_DMABUF)
+		return sync_dmabuf(setup->sources[index].fd, true);
+
+	return 0;
+}
+
+int video_engine_requests_recycle(struct video_setup *setup)
+{
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < setup->requests_count; i++) {
+		if (setup->requests[i].pending || !setup->requests[i].reinit)
+			continue;
+
+		rc = reinit_request(&setup->requests[i]);
+		if (rc < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int video_engine_controls_test(int video_fd, union controls *frame,
+			       struct video_setup *setup)
+{
+	struct v4l2_ext_control controls[VIDEO_CONTROLS_MAX];
+	unsigned int controls_index[VIDEO_CONTROLS_MAX];
+	unsigned int error_index;
+	unsigned int index;
+	unsigned int count = 0;
+	unsigned int i;
+	int rc;
+
+	memset(controls, 0, sizeof(controls));
 
-	rc = select(request_fd + 1, NULL, NULL, &except_fds, &tv);
-	if (rc == 0) {
-		fprintf(stderr, "Timeout when waiting for media request\n");
+#ifdef V4L2_PIX_FMT_H264_SLICE
+	/* Slice-based weighted prediction can't go without its tables. */
+	if (setup->stateless && setup->type == CODEC_TYPE_H264 &&
+	    !setup->frame_based &&
+	    ((frame->h264.pps.flags & V4L2_H264_PPS_FLAG_WEIGHTED_PRED) ||
+	     frame->h264.pps.weighted_bipred_idc == 1) &&
+	    !control_supported(setup,
+			       V4L2_CID_STATELESS_H264_PRED_WEIGHTS)) {
+		fprintf(stderr, "Missing prediction weights control\n");
 		return -1;
-	} else if (rc < 0) {
-		fprintf(stderr, "Unable to select media request: %s\n",
-			strerror(errno));
+	}
+#endif
+
+	frame = convert_controls(frame, setup);
+
+	for (i = 0; i < setup->controls_info_count; i++) {
+		if (!setup->controls_info[i].used)
+			continue;
+
+		index = setup->controls_info[i].index;
+
+		controls[count].id = format_controls[index].id;
+		controls[count].size = format_controls[index].size;
+		controls[count].ptr = (unsigned char *)frame +
+				      format_controls[index].offset;
+		controls_index[count] = index;
+		count++;
+	}
+
+	rc = set_controls(video_fd, -1, true, controls, count, &error_index);
+	if (rc < 0) {
+		if (error_index < count)
+			fprintf(stderr, "Invalid %s control\n",
+				format_controls[controls_index[error_index]].description);
+
 		return -1;
 	}
 
-	rc = dequeue_buffer(video_fd, -1, setup->output_type, index, 1,
-			    &source_error);
+	return 0;
+}
+
+int video_engine_buffer_map(int video_fd, struct video_buffer *buffer,
+			    struct video_setup *setup)
+{
+	unsigned int i, k;
+	void *map;
+	int fd;
+	off_t offset;
+
+	for (i = 0; i < buffer->destination_buffers_count; i++) {
+		if (buffer->destination_map[i] != NULL)
+			continue;
+
+		if (setup->destination_memory == V4L2_MEMORY_MMAP) {
+			fd = video_fd;
+			offset = buffer->destination_map_offsets[i];
+		} else {
+			fd = buffer->destination_fds[i];
+			offset = 0;
+		}
+
+		map = mmap(NULL, buffer->destination_map_lengths[i],
+			   PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "Unable to map destination buffer: %s\n",
+				strerror(errno));
+			return -1;
+		}
+
+		buffer->destination_map[i] = map;
+	}
+
+	for (i = 0; i < buffer->destination_planes_count; i++) {
+		k = buffer->destination_buffers_count > 1 ? i : 0;
+
+		buffer->destination_data[i] =
+			(unsigned char *)buffer->destination_map[k] +
+			buffer->destination_offsets[i];
+	}
+
+	return 0;
+}
+
+/*
+ * Complete whichever request the driver returns first, that may not be the
+ * one that woke the caller up: buffers are matched by their dequeued index
+ * and timestamp. The media request of the completed source is returned so
+ * that it is no longer waited for.
+ */
+int video_engine_complete(int video_fd, struct video_buffer *buffers,
+			  unsigned int buffers_count, struct video_setup *setup,
+			  unsigned int *index, int *request_fd)
+{
+	unsigned int source_index, destination_index;
+	unsigned int source_flags, destination_flags;
+	unsigned int destination_sequence;
+	uint64_t destination_ts;
+	struct timespec wakeup_time;
+	struct video_source *source;
+	struct video_buffer *buffer;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &wakeup_time);
+
+	rc = dequeue_buffer(video_fd, -1, setup->output_type,
+			    setup->source_memory, &source_index, NULL, NULL, 1,
+			    &source_flags);
 	if (rc < 0) {
 		fprintf(stderr, "Unable to dequeue source buffer\n");
 		return -1;
 	}
 
-	rc = dequeue_buffer(video_fd, -1, setup->capture_type, index,
-			    buffers[index].destination_buffers_count,
-			    &destination_error);
+	if (source_index >= setup->sources_count ||
+	    !setup->sources[source_index].pending) {
+		fprintf(stderr,
+			"Dequeued source buffer %d does not match any pending request\n",
+			source_index);
+		return -1;
+	}
+
+	source = &setup->sources[source_index];
+
+	/* Reinitialization is left for later, off the completion path. */
+	setup->requests[source->request_index].pending = false;
+	setup->requests_pending--;
+
+	source->pending = false;
+
+	if (request_fd != NULL)
+		*request_fd = setup->requests[source->request_index].fd;
+
+	buffers[source->destination_index].wakeup_time = wakeup_time;
+
+	if (source_flags & V4L2_BUF_FLAG_ERROR) {
+		fprintf(stderr, "Error encountered during decoding\n");
+		return -1;
+	}
+
+	if (index != NULL)
+		*index = source->destination_index;
+
+	/* Held destination buffers are only returned with the last slice. */
+	if (source->hold)
+		return 0;
+
+	rc = dequeue_buffer(video_fd, -1, setup->capture_type,
+			    setup->destination_memory, &destination_index,
+			    &destination_ts, &destination_sequence,
+			    buffers[0].destination_buffers_count,
+			    &destination_flags);
 	if (rc < 0) {
 		fprintf(stderr, "Unable to dequeue destination buffer\n");
 		return -1;
 	}
 
-	if (source_error || destination_error) {
+	if (destination_index >= buffers_count ||
+	    buffers[destination_index].state != VIDEO_BUFFER_STATE_PENDING ||
+	    buffers[destination_index].ts != destination_ts) {
+		fprintf(stderr,
+			"Dequeued destination buffer %d does not match any pending request\n",
+			destination_index);
+		return -1;
+	}
+
+	buffer = &buffers[destination_index];
+	buffer->wakeup_time = wakeup_time;
+
+	clock_gettime(CLOCK_MONOTONIC, &buffer->dequeue_time);
+
+	buffer->sequence = destination_sequence;
+	buffer->flags = destination_flags;
+
+	if (destination_flags & V4L2_BUF_FLAG_ERROR) {
 		fprintf(stderr, "Error encountered during decoding\n");
 		return -1;
 	}
 
-	rc = ioctl(request_fd, MEDIA_REQUEST_IOC_REINIT, NULL);
+	buffer->state = VIDEO_BUFFER_STATE_DECODED;
+
+	if (index != NULL)
+		*index = destination_index;
+
+	return 0;
+}
+
+int video_engine_dequeue_event(int video_fd, unsigned int *type,
+			       unsigned int *changes)
+{
+	struct v4l2_event event;
+	int rc;
+
+	memset(&event, 0, sizeof(event));
+
+	rc = ioctl(video_fd, VIDIOC_DQEVENT, &event);
 	if (rc < 0) {
-		fprintf(stderr, "Unable to reinit media request: %s\n",
+		fprintf(stderr, "Unable to dequeue event: %s\n",
 			strerror(errno));
 		return -1;
 	}
 
+	if (type != NULL)
+		*type = event.type;
+
+	if (changes != NULL)
+		*changes = event.type == V4L2_EVENT_SOURCE_CHANGE ?
+			   event.u.src_change.changes : 0;
+
 	return 0;
 }